@@ -0,0 +1,727 @@
+/**
+ * Implementation File for the compiled batch file cache
+ *
+ * Compiles a batch file into an image of parsed command lines,
+ *      stores it as <batch file>.bc and reuses it on later runs
+ *      as long as the batch file and the shell build haven't changed
+ *
+ * @author Sam Kapp
+*/
+#include "batch_cache.h"
+#include "commands.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Set in an encoded node's type when it ends in '&'
+#define BC_NODE_BACKGROUND 8
+
+// Growable byte buffer used while compiling
+struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Table of strings already placed in the string block
+struct intern_table {
+    // offset + 1 of each string, 0 for an empty slot
+    uint64_t *slots;
+    size_t cap;
+    size_t count;
+};
+
+// Everything built up while compiling a script
+struct compiler {
+    struct buffer records;
+    struct buffer strings;
+    struct intern_table table;
+    uint64_t command_count;
+    uint32_t max_tokens;
+    uint32_t max_nodes;
+    uint32_t max_heredocs;
+    // NUL terminated copy of the current line and its words
+    char *line;
+    char **words;
+    size_t line_cap;
+};
+
+/**
+ * Hashes the batch file 8 bytes at a time
+*/
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+    }
+    return h ^ (h >> 32);
+}
+
+/**
+ * Hash used for interning tokens
+*/
+static uint64_t hash_token(const char *token, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) token[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Makes room for n more bytes in buf
+*/
+static int reserve(struct buffer *buf, size_t n) {
+    if (buf->len + n <= buf->cap) {
+        return 0;
+    }
+    size_t cap = (buf->cap == 0) ? 4096 : buf->cap;
+    while (buf->len + n > cap) {
+        cap *= 2;
+    }
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+/**
+ * Returns the offset of token in the string block,
+ *      adding it if it isn't there yet
+ * Returns -1 if the string block can't grow any further
+*/
+static int64_t intern(struct intern_table *table, struct buffer *strings, const char *token, size_t len) {
+    // Keep the table at most half full
+    if ((table->count + 1) * 2 > table->cap) {
+        size_t cap = (table->cap == 0) ? 1024 : table->cap * 2;
+        uint64_t *slots = calloc(cap, sizeof(uint64_t));
+        if (slots == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < table->cap; i++) {
+            if (table->slots[i] != 0) {
+                const char *s = strings->data + table->slots[i] - 1;
+                size_t j = hash_token(s, strlen(s)) & (cap - 1);
+                while (slots[j] != 0) {
+                    j = (j + 1) & (cap - 1);
+                }
+                slots[j] = table->slots[i];
+            }
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->cap = cap;
+    }
+
+    size_t i = hash_token(token, len) & (table->cap - 1);
+    while (table->slots[i] != 0) {
+        const char *s = strings->data + table->slots[i] - 1;
+        if (strncmp(s, token, len) == 0 && s[len] == '\0') {
+            return table->slots[i] - 1;
+        }
+        i = (i + 1) & (table->cap - 1);
+    }
+
+    // Offsets are stored as 32 bits in the image
+    if (strings->len + len + 1 > UINT32_MAX || reserve(strings, len + 1) != 0) {
+        return -1;
+    }
+    int64_t offset = strings->len;
+    memcpy(strings->data + strings->len, token, len);
+    strings->data[strings->len + len] = '\0';
+    strings->len += len + 1;
+
+    table->slots[i] = offset + 1;
+    table->count++;
+    return offset;
+}
+
+/**
+ * Returns the wall clock in nanoseconds
+*/
+static int64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Appends value to buf as a varint, 7 bits per byte, low bits first
+*/
+static int put_varint(struct buffer *buf, uint64_t value) {
+    if (reserve(buf, 10) != 0) {
+        return -1;
+    }
+    while (value >= 0x80) {
+        buf->data[buf->len++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    buf->data[buf->len++] = (char) value;
+    return 0;
+}
+
+/**
+ * Reads the varint at the image's cursor, which must stay before end
+*/
+static int get_varint(struct batch_image *image, size_t end, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && image->cursor < end; shift += 7) {
+        unsigned char byte = image->image[image->cursor++];
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Appends a node and everything under it in prefix order:
+ *      type, first token, token count, then its children
+ * 
+ * Lines with here-documents also store each node's bodies after 
+ *      its token count: how many, then expand and string offset of each
+*/
+static int encode_node(struct compiler *c, const struct node *node, int flags, uint32_t *count, uint32_t *heredocs) {
+    struct buffer *records = &c->records;
+    (*count)++;
+    uint64_t type = node->type | (node->background ? BC_NODE_BACKGROUND : 0);
+    if (put_varint(records, type) != 0 || put_varint(records, node->first) != 0 ||
+        put_varint(records, node->argc) != 0) {
+        return -1;
+    }
+    if (flags & BC_HEREDOC) {
+        if (put_varint(records, node->heredoc_count) != 0) {
+            return -1;
+        }
+        for (int i = 0; i < node->heredoc_count; i++) {
+            const char *body = node->heredocs[i].body;
+            int64_t offset = intern(&c->table, &c->strings, body, strlen(body));
+            if (offset < 0 || put_varint(records, node->heredocs[i].expand) != 0 ||
+                put_varint(records, offset) != 0) {
+                return -1;
+            }
+        }
+        *heredocs += node->heredoc_count;
+    }
+    switch (node->type) {
+        case NODE_SEQ:
+        case NODE_AND:
+        case NODE_OR:
+            if (encode_node(c, node->left, flags, count, heredocs) != 0) {
+                return -1;
+            }
+            return encode_node(c, node->right, flags, count, heredocs);
+        case NODE_SUBSHELL:
+        case NODE_GROUP:
+            return encode_node(c, node->body, flags, count, heredocs);
+        case NODE_CMD:
+            break;
+    }
+    return 0;
+}
+
+/**
+ * Splits one line into words the same way batch_mode() does,
+ *      parses it and appends its record
+ * Here-document bodies are read from the rest of the script, 
+ *      which is rest_size bytes long, and body_length is set to their length
+ * 
+ * Lines that parse() has to see at run time (history and syntax errors)
+ *      keep their words as they are and get no tree
+*/
+static int compile_line(struct compiler *c, const char *start, size_t length, size_t rest_size, size_t *body_length) {
+    // Record fields are 32 bits wide
+    if (length > UINT32_MAX) {
+        return -1;
+    }
+    if (length + 1 > c->line_cap) {
+        char *line = realloc(c->line, length + 1);
+        char **words = realloc(c->words, sizeof(char *) * (length + 2));
+        if (line != NULL) {
+            c->line = line;
+        }
+        if (words != NULL) {
+            c->words = words;
+        }
+        if (line == NULL || words == NULL) {
+            return -1;
+        }
+        c->line_cap = length + 1;
+    }
+    memcpy(c->line, start, length);
+    c->line[length] = '\0';
+
+    int flags = 0;
+    int argc = 0;
+    char *word = strtok(c->line, " \n\r\t");
+    bool heredoc = false;
+    while (word != NULL) {
+        if (strncmp(word, "<<", 2) == 0 && word[2] != '<') {
+            heredoc = true;
+        }
+        c->words[argc++] = word;
+        word = strtok(NULL, " \n\r\t");
+    }
+    c->words[argc] = NULL;
+
+    struct cmd_tree *tree = NULL;
+    if (argc > 0 && strcmp(c->words[0], "history") != 0) {
+        tree = build_tree_quiet(argc, c->words);
+    }
+    *body_length = 0;
+    if (tree != NULL && heredoc) {
+        // Read the bodies the way parse() does, straight after the line
+        FILE *rest = (rest_size > 0) ? fmemopen((char *) start + length, rest_size, "r") : fopen("/dev/null", "r");
+        if (rest == NULL) {
+            free_tree(tree);
+            return -1;
+        }
+        read_heredocs(tree, rest);
+        *body_length = ftell(rest);
+        fclose(rest);
+        flags |= BC_HEREDOC;
+    }
+
+    char **tokens = c->words;
+    int token_count = argc;
+    if (tree != NULL) {
+        tokens = tree->tokens;
+        token_count = tree->token_count;
+        if (!(flags & BC_HEREDOC) && tree->root->type == NODE_CMD && tree->root->argc == token_count) {
+            flags |= BC_SIMPLE;
+        } else {
+            flags |= BC_TREE;
+        }
+    }
+
+    int status = -1;
+    uint32_t node_count = (flags & BC_SIMPLE) ? 1 : 0;
+    uint32_t heredoc_count = 0;
+    if (put_varint(&c->records, length) != 0 || put_varint(&c->records, flags) != 0 ||
+        ((flags & BC_HEREDOC) && put_varint(&c->records, *body_length) != 0) ||
+        put_varint(&c->records, token_count) != 0) {
+        goto done;
+    }
+    for (int i = 0; i < token_count; i++) {
+        int64_t offset = intern(&c->table, &c->strings, tokens[i], strlen(tokens[i]));
+        if (offset < 0 || put_varint(&c->records, offset) != 0) {
+            goto done;
+        }
+    }
+    if ((flags & BC_TREE) && encode_node(c, tree->root, flags, &node_count, &heredoc_count) != 0) {
+        goto done;
+    }
+
+    if ((uint32_t) token_count > c->max_tokens) {
+        c->max_tokens = token_count;
+    }
+    if (node_count > c->max_nodes) {
+        c->max_nodes = node_count;
+    }
+    if (heredoc_count > c->max_heredocs) {
+        c->max_heredocs = heredoc_count;
+    }
+    c->command_count++;
+    status = 0;
+
+done:
+    if (tree != NULL) {
+        free_tree(tree);
+    }
+    return status;
+}
+
+/**
+ * Compiles the whole script, one record per line
+ * On success image->image holds the compiled image in malloc'd memory
+*/
+static int compile(struct batch_image *image, const struct stat *st) {
+    struct compiler c;
+    memset(&c, 0, sizeof(c));
+    int status = -1;
+    // Taken before reading the script, so a change made while compiling looks recent
+    int64_t compiled_at = wall_ns();
+
+    const char *script = image->script;
+    size_t pos = 0;
+    while (pos < image->script_size) {
+        const char *newline = memchr(script + pos, '\n', image->script_size - pos);
+        size_t line_end = (newline != NULL) ? (size_t) (newline - script) + 1 : image->script_size;
+        size_t body_length;
+        if (compile_line(&c, script + pos, line_end - pos, image->script_size - line_end, &body_length) != 0) {
+            goto done;
+        }
+        pos = line_end + body_length;
+    }
+
+    // Lay out header, records and strings in a single block
+    struct bc_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BC_MAGIC, 4);
+    header.format_version = BC_FORMAT_VERSION;
+    strncpy(header.build_id, SHELL_BUILD_ID, sizeof(header.build_id) - 1);
+    header.script_hash = hash_bytes(image->script, image->script_size);
+    header.script_size = image->script_size;
+    header.script_mtime = (int64_t) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    header.script_inode = st->st_ino;
+    header.compiled_at = compiled_at;
+    header.command_count = c.command_count;
+    header.records_size = c.records.len;
+    header.strings_size = c.strings.len;
+    header.max_tokens = c.max_tokens;
+    header.max_nodes = c.max_nodes;
+    header.max_heredocs = c.max_heredocs;
+
+    image->image_size = sizeof(header) + c.records.len + c.strings.len;
+    image->image = malloc(image->image_size);
+    if (image->image == NULL) {
+        goto done;
+    }
+    memcpy(image->image, &header, sizeof(header));
+    if (c.records.len > 0) {
+        memcpy(image->image + sizeof(header), c.records.data, c.records.len);
+    }
+    if (c.strings.len > 0) {
+        memcpy(image->image + sizeof(header) + c.records.len, c.strings.data, c.strings.len);
+    }
+    image->image_mapped = 0;
+    status = 0;
+
+done:
+    free(c.line);
+    free(c.words);
+    free(c.table.slots);
+    free(c.records.data);
+    free(c.strings.data);
+    return status;
+}
+
+/**
+ * Checks that a cached image belongs to this version of the script and shell
+ *
+ * The script only has to be hashed if it was changed close enough
+ *      to compiling that its mtime can't be trusted
+*/
+static int is_valid(const char *image, size_t image_size, const struct batch_image *script, const struct stat *st) {
+    if (image_size < sizeof(struct bc_header)) {
+        return 0;
+    }
+    const struct bc_header *header = (const struct bc_header *) image;
+    int64_t mtime = (int64_t) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    if (memcmp(header->magic, BC_MAGIC, 4) != 0 ||
+        header->format_version != BC_FORMAT_VERSION ||
+        strncmp(header->build_id, SHELL_BUILD_ID, sizeof(header->build_id) - 1) != 0 ||
+        header->records_size > image_size - sizeof(struct bc_header) ||
+        header->strings_size != image_size - sizeof(struct bc_header) - header->records_size ||
+        (header->strings_size > 0 && image[image_size - 1] != '\0')) {
+        return 0;
+    }
+    if (header->script_size != script->script_size || header->script_mtime != mtime ||
+        header->script_inode != (uint64_t) st->st_ino) {
+        return 0;
+    }
+    if (mtime + 1000000000LL > header->compiled_at) {
+        return header->script_hash == hash_bytes(script->script, script->script_size);
+    }
+    return 1;
+}
+
+/**
+ * Writes the compiled image next to the script
+ * Written to a temporary file first so a reader never sees half an image
+*/
+static void store(const char *cache_path, const struct batch_image *image) {
+    char tmp_path[strlen(cache_path) + 32];
+    sprintf(tmp_path, "%s.tmp%d", cache_path, (int) getpid());
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    const char *data = image->image;
+    size_t len = image->image_size;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    if (close(fd) != 0 || len > 0 || rename(tmp_path, cache_path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Opens the compiled image for script_path
+ *
+ * The cached image is used if the script is the one it was compiled 
+ *      from and the shell build matches, otherwise the script is 
+ *      compiled again and the cache rewritten
+ *
+ * Returns 0 on success, -1 if the script can't be compiled
+*/
+int batch_image_open(const char *script_path, struct batch_image *image) {
+    memset(image, 0, sizeof(*image));
+
+    // Map the script, only the lines used for history are ever read
+    int fd = open(script_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat script_st;
+    if (fstat(fd, &script_st) != 0) {
+        close(fd);
+        return -1;
+    }
+    image->script_size = script_st.st_size;
+    if (image->script_size > 0) {
+        image->script = mmap(NULL, image->script_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image->script == MAP_FAILED) {
+            image->script = NULL;
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    char cache_path[strlen(script_path) + 4];
+    sprintf(cache_path, "%s.bc", script_path);
+
+    // Try the cached image first
+    fd = open(cache_path, O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            char *cached = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (cached != MAP_FAILED) {
+                if (is_valid(cached, st.st_size, image, &script_st)) {
+                    madvise(cached, st.st_size, MADV_SEQUENTIAL);
+                    image->image = cached;
+                    image->image_size = st.st_size;
+                    image->image_mapped = 1;
+                } else {
+                    munmap(cached, st.st_size);
+                }
+            }
+        }
+        close(fd);
+    }
+
+    // Missing or stale, compile it again
+    if (image->image == NULL) {
+        if (compile(image, &script_st) != 0) {
+            batch_image_close(image);
+            return -1;
+        }
+        store(cache_path, image);
+    }
+
+    image->header = (const struct bc_header *) image->image;
+    image->strings = image->image + sizeof(struct bc_header) + image->header->records_size;
+    image->cursor = sizeof(struct bc_header);
+
+    // Buffers every line is decoded into
+    size_t max_tokens = image->header->max_tokens;
+    size_t max_nodes = image->header->max_nodes;
+    size_t max_heredocs = image->header->max_heredocs;
+    image->line.argv = malloc(sizeof(char *) * (max_tokens + 1));
+    image->nodes = malloc(sizeof(struct node) * (max_nodes + 1));
+    image->words = malloc(sizeof(char *) * (max_tokens + max_nodes + 1));
+    image->heredocs = malloc(sizeof(struct heredoc) * (max_heredocs + 1));
+    if (image->line.argv == NULL || image->nodes == NULL || image->words == NULL || image->heredocs == NULL) {
+        batch_image_close(image);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Takes the next node out of the line's node buffer
+ * Its argv is argc tokens of the line starting at first
+*/
+static struct node *take_node(struct batch_image *image, uint64_t type, uint64_t first, uint64_t argc) {
+    struct bc_line *line = &image->line;
+    if ((uint64_t) image->node_count >= image->header->max_nodes ||
+        first > (uint64_t) line->argc || argc > line->argc - first ||
+        image->word_count + argc + 1 > image->header->max_tokens + image->header->max_nodes + 1) {
+        return NULL;
+    }
+
+    struct node *node = &image->nodes[image->node_count++];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->first = first;
+    node->argc = argc;
+    node->argv = &image->words[image->word_count];
+    for (uint64_t i = 0; i < argc; i++) {
+        node->argv[i] = line->argv[first + i];
+    }
+    node->argv[argc] = NULL;
+    image->word_count += argc + 1;
+    return node;
+}
+
+/**
+ * Takes the node's here-document bodies out of the line's buffer
+ * Returns -1 if the image is damaged
+*/
+static int take_heredocs(struct batch_image *image, size_t end, struct node *node) {
+    uint64_t count;
+    if (get_varint(image, end, &count) != 0 ||
+        count > image->header->max_heredocs - image->heredoc_count) {
+        return -1;
+    }
+    node->heredocs = &image->heredocs[image->heredoc_count];
+    node->heredoc_count = count;
+    image->heredoc_count += count;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t expand, offset;
+        if (get_varint(image, end, &expand) != 0 || get_varint(image, end, &offset) != 0 ||
+            offset >= image->header->strings_size) {
+            return -1;
+        }
+        node->heredocs[i].expand = expand != 0;
+        node->heredocs[i].body = (char *) image->strings + offset;
+    }
+    return 0;
+}
+
+/**
+ * Decodes a node written by encode_node() and everything under it
+ * Returns NULL if the image is damaged
+*/
+static struct node *decode_node(struct batch_image *image, size_t end, int flags) {
+    uint64_t type, first, argc;
+    if (get_varint(image, end, &type) != 0 || get_varint(image, end, &first) != 0 ||
+        get_varint(image, end, &argc) != 0) {
+        return NULL;
+    }
+    bool background = (type & BC_NODE_BACKGROUND) != 0;
+    type &= ~(uint64_t) BC_NODE_BACKGROUND;
+    if (type > NODE_GROUP) {
+        return NULL;
+    }
+    struct node *node = take_node(image, type, first, argc);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->background = background;
+    if ((flags & BC_HEREDOC) && take_heredocs(image, end, node) != 0) {
+        return NULL;
+    }
+
+    switch (node->type) {
+        case NODE_SEQ:
+        case NODE_AND:
+        case NODE_OR:
+            if ((node->left = decode_node(image, end, flags)) == NULL ||
+                (node->right = decode_node(image, end, flags)) == NULL) {
+                return NULL;
+            }
+            break;
+        case NODE_SUBSHELL:
+        case NODE_GROUP:
+            if ((node->body = decode_node(image, end, flags)) == NULL) {
+                return NULL;
+            }
+            break;
+        case NODE_CMD:
+            break;
+    }
+    return node;
+}
+
+/**
+ * Decodes the next line of the image
+ *
+ * The line and its tree live in buffers owned by the image and are 
+ *      overwritten by the next call, the tree must not be freed. 
+ *      Its strings point into the image, so they must not be modified
+ *
+ * Returns NULL once every line has been decoded, or if the image is damaged
+*/
+struct bc_line *batch_image_next(struct batch_image *image) {
+    size_t end = sizeof(struct bc_header) + image->header->records_size;
+    if (image->cursor >= end) {
+        return NULL;
+    }
+
+    struct bc_line *line = &image->line;
+    uint64_t length, flags, body_length = 0, count;
+    if (get_varint(image, end, &length) != 0 || get_varint(image, end, &flags) != 0 ||
+        ((flags & BC_HEREDOC) && get_varint(image, end, &body_length) != 0) ||
+        get_varint(image, end, &count) != 0 || length > UINT32_MAX ||
+        count > image->header->max_tokens) {
+        return NULL;
+    }
+    line->line_start += line->line_length + line->body_length;
+    line->line_length = length;
+    line->body_length = body_length;
+    line->flags = flags;
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t offset;
+        if (get_varint(image, end, &offset) != 0 || offset >= image->header->strings_size) {
+            return NULL;
+        }
+        line->argv[i] = (char *) image->strings + offset;
+    }
+    line->argv[count] = NULL;
+    line->argc = count;
+
+    image->node_count = 0;
+    image->word_count = 0;
+    image->heredoc_count = 0;
+    line->tree.root = NULL;
+    if (flags & BC_SIMPLE) {
+        line->tree.root = take_node(image, NODE_CMD, 0, count);
+    } else if (flags & BC_TREE) {
+        line->tree.root = decode_node(image, end, flags);
+    }
+    if ((flags & (BC_SIMPLE | BC_TREE)) && line->tree.root == NULL) {
+        return NULL;
+    }
+    line->tree.tokens = line->argv;
+    line->tree.token_count = count;
+    return line;
+}
+
+/**
+ * Releases the image, the mapped script and the line buffers
+*/
+void batch_image_close(struct batch_image *image) {
+    if (image->image != NULL) {
+        if (image->image_mapped) {
+            munmap(image->image, image->image_size);
+        } else {
+            free(image->image);
+        }
+    }
+    if (image->script != NULL) {
+        munmap(image->script, image->script_size);
+    }
+    free(image->line.argv);
+    free(image->nodes);
+    free(image->words);
+    free(image->heredocs);
+    memset(image, 0, sizeof(*image));
+}
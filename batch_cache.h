@@ -0,0 +1,108 @@
+/**
+ * Header file for the compiled batch file cache
+ *
+ * A batch file is tokenized and parsed once into a compact image stored
+ *      next to it (files.bat -> files.bat.bc). Later runs mmap the image
+ *      and run the parsed command trees directly, no line is split
+ *      into words or parsed again.
+ *
+ * Image layout, all offsets are relative so the image can be mapped anywhere:
+ *      bc_header
+ *      one record per line, every number a varint (7 bits per byte):
+ *          line length, flags, length of the here-document bodies after it,
+ *          token count, token string offsets, then the command tree 
+ *          in prefix order if the line has one
+ *      string block, every distinct token and here-document body stored once
+ *
+ * The image is trusted as long as the script's size, mtime and inode are
+ *      the ones it was compiled from, by the same build of the shell. A script changed within a second of
+ *      compiling is hashed as well, in case the mtime didn't move.
+ *
+ * @author Sam Kapp
+*/
+#ifndef BATCH_CACHE_H
+#define BATCH_CACHE_H
+
+#include "control.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Identifies the build, an image compiled by any other build is stale
+// The makefile derives it from the sources
+#ifndef SHELL_BUILD_ID
+#define SHELL_BUILD_ID __DATE__ " " __TIME__
+#endif
+#define BC_MAGIC "SHBC"
+#define BC_FORMAT_VERSION 4
+
+// Record flag: here-document bodies follow the line, stored with its tree
+#define BC_HEREDOC 1
+// Record flag: the command tree follows the tokens
+#define BC_TREE 2
+// Record flag: the line is one plain command of all its tokens, no tree is stored
+#define BC_SIMPLE 4
+
+struct bc_header {
+    char magic[4];
+    uint32_t format_version;
+    char build_id[32];
+    uint64_t script_hash;
+    uint64_t script_size;
+    // Identity of the script compiled, mtime in nanoseconds
+    int64_t script_mtime;
+    uint64_t script_inode;
+    // Wall clock time the image was compiled at, in nanoseconds
+    int64_t compiled_at;
+    uint64_t command_count;
+    uint64_t records_size;
+    uint64_t strings_size;
+    // Most tokens, tree nodes and here-documents on a single line
+    uint32_t max_tokens;
+    uint32_t max_nodes;
+    uint32_t max_heredocs;
+};
+
+// One line of the image, decoded by batch_image_next()
+struct bc_line {
+    uint64_t line_start;
+    uint32_t line_length;
+    // Here-document bodies read along with the line
+    uint64_t body_length;
+    int flags;
+    // Words of the line, split at operators when it was parsed
+    int argc;
+    char **argv;
+    // Parsed line, tree.root is NULL if the line has to go through parse()
+    //      (history, blank lines and syntax errors)
+    struct cmd_tree tree;
+};
+
+struct batch_image {
+    // Mapped (or compiled in memory) image
+    char *image;
+    size_t image_size;
+    int image_mapped;
+    // Mapped script, used for hashing and history entries
+    char *script;
+    size_t script_size;
+
+    const struct bc_header *header;
+    const char *strings;
+    // Offset of the next record to run
+    size_t cursor;
+
+    // Reused for every line, sized by the header
+    struct bc_line line;
+    struct node *nodes;
+    char **words;
+    struct heredoc *heredocs;
+    int node_count;
+    int word_count;
+    int heredoc_count;
+};
+
+int batch_image_open(const char *script_path, struct batch_image *image);
+struct bc_line *batch_image_next(struct batch_image *image);
+void batch_image_close(struct batch_image *image);
+
+#endif
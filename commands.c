@@ -4,11 +4,19 @@
  * Deals with cd, and exit commands 
  * Along with all simple commands
  * Can handle redirection 
+ * Can handle here-documents and here-strings
  * Can handle a single pipe
+ * Lists and conditionals are handled in control.c
+ * Can run a command over many inputs in parallel
+ * Resource limits (ulimit, limit) are handled in joblimits.c
  * 
  * @author Sam Kapp
 */
+#define _GNU_SOURCE
 #include "commands.h"
+#include "control.h"
+#include "trace.h"
+#include "joblimits.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -16,48 +24,143 @@
 #include <sys/wait.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+// Where here-document bodies are read from, stdin when NULL
+FILE *heredoc_input = NULL;
+
+// Exit status of the last command run
+int last_status = 0;
+
+// Here-document bodies of the command about to run, see use_heredocs()
+static struct heredoc *pending_heredocs = NULL;
+static int pending_heredoc_count = 0;
+
+// Set in a forked subshell, which has to leave with _exit()
+bool in_subshell = false;
+
+// Commands run_cmd() handles in the shell itself
+static const char *builtins[] = {"exit", "cd", "ulimit", "limit", "parallel", "trace", NULL};
+
+// Background jobs reaped by parallel while it waited for its own jobs,
+//      handed over to be reported with the other finished background jobs
+static pid_t *finished_pids = NULL;
+static int *finished_statuses = NULL;
+static int finished_count = 0;
+static int finished_cap = 0;
 
 /**
- * Takes argc and argv and runs the appropriate command for it
+ * Takes argc and argv, splits it into its lists, conditionals, 
+ *      subshells and groups and runs them
 */
 void parse(int argc, char *argv[]) {
+    if (argc == 0) {
+        return;
+    }
+    uint64_t start = trace_now();
+    struct cmd_tree *tree = build_tree(argc, argv);
+    trace_span_argv("parse", argc, argv, start);
+    if (tree == NULL) {
+        trace_instant("error", "syntax error");
+        last_status = 2;
+        return;
+    }
+    read_heredocs(tree, (heredoc_input != NULL) ? heredoc_input : stdin);
+
+    run_parsed(tree, argc, argv);
+    free_tree(tree);
+}
+
+/**
+ * Runs a command line already parsed into tree
+ * argv holds the words of the line, used to name it in the trace
+*/
+void run_parsed(struct cmd_tree *tree, int argc, char *argv[]) {
+    uint64_t start = trace_now();
+    run_tree(tree);
+    trace_span_argv("line", argc, argv, start);
+
+    // Write the trace here if SIGUSR1 asked for it
+    trace_poll();
+}
+
+/**
+ * Takes argc and argv of a single command (no lists or conditionals) 
+ *      and runs the appropriate command for it
+ * 
+ * Returns the command's exit status, also kept in last_status
+*/
+int run_cmd(int argc, char *argv[]) {
+    int result;
     // Check for which command to run
     if (strcmp(argv[0], "exit") == 0) {
-        exit_cmd(argc, argv);
+        last_status = exit_cmd(argc, argv);
     } else if (strcmp(argv[0], "cd") == 0) {
-        cd_cmd(argc, argv);
-    } else if (redirection_cmd(argc, argv) != 0) {
-        return;
-    } else if (pipe_cmd(argc, argv) != 0) {
-        return; 
+        last_status = cd_cmd(argc, argv);
+    } else if (strcmp(argv[0], "limit") == 0) {
+        // Before redirection and pipes, they belong to the limited command
+        last_status = limit_cmd(argc, argv);
+    } else if ((result = redirection_cmd(argc, argv)) != 0) {
+        // Status was set by the redirected command
+        if (result == -1) {
+            last_status = 1;
+        }
+    } else if ((result = pipe_cmd(argc, argv)) != 0) {
+        // Status was set by the pipe
+        if (result == -1) {
+            last_status = 1;
+        }
+    } else if (strcmp(argv[0], "ulimit") == 0) {
+        last_status = ulimit_cmd(argc, argv);
+    } else if (strcmp(argv[0], "parallel") == 0) {
+        last_status = parallel_cmd(argc, argv);
+    } else if (strcmp(argv[0], "trace") == 0) {
+        last_status = trace_cmd(argc, argv);
     } else {
-        simple_cmd(argc, argv);
+        last_status = simple_cmd(argc, argv);
     }
 
+    return last_status;
 }
 
 /**
  * Executes the exit command in the shell
 */
-void exit_cmd(int argc, char *argv[]) {
+int exit_cmd(int argc, char *argv[]) {
     if (argc != 1) {
         printf("exit: too many arguments.\n");
-        return;
+        return 1;
     } else {
         printf("\033[38;5;39m");        
         printf("\nStay safe out there in the dessert.\n");
         printf("\033[0m");
+        if (in_subshell) {
+            // Only leaves the subshell
+            exit_child(0);
+        }
         exit(0);
     }
 }
 
+/**
+ * Leaves a forked child of the shell that never exec'd
+ * Uses _exit(), exit() would move the batch file's shared 
+ *      read offset back under the shell
+*/
+void exit_child(int status) {
+    fflush(stdout);
+    _exit(status);
+}
+
 /**
  * Executes the cd command in the shell
 */
-void cd_cmd(int argc, char *argv[]) {
+int cd_cmd(int argc, char *argv[]) {
     if (argc > 2) {
         printf("cd: too many arguments.\n");
-        return;
+        return 1;
     } else {
         char *dir = NULL; 
         if (argc == 1 || strcmp(argv[1], "~") == 0) {
@@ -68,8 +171,82 @@ void cd_cmd(int argc, char *argv[]) {
 
         if (chdir(dir) != 0) {
             printf("chdir() error.\n");
+            return 1;
         }
     }
+    return 0;
+}
+
+/**
+ * Opens the pipe that tells the parent when a child's exec is done
+ * Its write end is close-on-exec, so the parent reads EOF once exec succeeds
+ * Only opened while tracing, otherwise both ends are -1
+*/
+static void exec_watch_open(int watch[2]) {
+    watch[0] = -1;
+    watch[1] = -1;
+    if (trace_active() && pipe2(watch, O_CLOEXEC) == -1) {
+        watch[0] = -1;
+        watch[1] = -1;
+    }
+}
+
+/**
+ * Tells the parent, from the child, that the command never got exec'd
+ * reason is 'l' if the job limits couldn't be set, 'x' if exec failed
+*/
+static void exec_watch_fail(int watch[2], char reason) {
+    if (watch[1] != -1) {
+        write(watch[1], &reason, 1);
+    }
+}
+
+/**
+ * Closes the exec pipe when no child was started
+*/
+static void exec_watch_close(int watch[2]) {
+    if (watch[0] != -1) {
+        close(watch[0]);
+        close(watch[1]);
+    }
+}
+
+/**
+ * Waits in the parent until the child has exec'd or given up
+ *      and records the exec span from start up to then
+*/
+static void exec_watch_wait(int watch[2], int argc, char *argv[], uint64_t start) {
+    if (watch[0] == -1) {
+        return;
+    }
+    close(watch[1]);
+    char reason;
+    ssize_t n;
+    while ((n = read(watch[0], &reason, 1)) == -1 && errno == EINTR) {
+        trace_poll();
+    }
+    close(watch[0]);
+    trace_span_argv("exec", argc, argv, start);
+    if (n == 1) {
+        trace_instant("error", (reason == 'l') ? "limits not applied" : "command not found");
+    }
+}
+
+/**
+ * Replaces a forked child with the command in argv, never returns
+ * The job limits are set first, a child that can't set them 
+ *      or exec the command exits with 126 or 127
+*/
+static void exec_job(char *argv[], int watch[2]) {
+    if (apply_job_limits() != 0) {
+        exec_watch_fail(watch, 'l');
+        _exit(126);
+    }
+    execvp(argv[0], argv);
+    printf("%s: command not found.\n", argv[0]);
+    fflush(stdout);
+    exec_watch_fail(watch, 'x');
+    _exit(127);
 }
 
 /**
@@ -79,8 +256,10 @@ void cd_cmd(int argc, char *argv[]) {
  * The child process will call execvp and replace its space 
  *      with the disk image of the given command 
  * The child will then run the command
+ * 
+ * Returns the command's exit status
 */
-void simple_cmd(int argc, char *argv[]) {
+int simple_cmd(int argc, char *argv[]) {
     // Check for '&'
     bool run_background = false; 
     if (strcmp(argv[argc-1], "&") == 0) {
@@ -89,128 +268,488 @@ void simple_cmd(int argc, char *argv[]) {
     }
 
     // Fork the process
+    int watch[2];
+    exec_watch_open(watch);
+    fflush(stdout);
+    uint64_t start = trace_now();
     pid_t pid = fork(); 
 
     if (pid == -1) {
         printf("fork() error.\n");
-        return;
+        trace_instant("error", "fork() error");
+        exec_watch_close(watch);
+        return 1;
     } else if (pid == 0) { 
         // Child 
-        if (execvp(argv[0], argv) == -1) {
-            printf("%s: command not found.\n", argv[0]);
-            return;
-        }
+        exec_job(argv, watch);
     } else  {
         // Parent
+        trace_span_argv("spawn", argc, argv, start);
+        exec_watch_wait(watch, argc, argv, trace_now());
         if (run_background) {
             printf("Background Process: %d\n", pid);\
         } else {
-            wait(NULL);
+            start = trace_now();
+            int status = wait_status(pid);
+            trace_span_argv("wait", argc, argv, start);
+            return status;
         }
     }
+    return 0;
 }
 
 /**
- * Checks for redirection 
- * If present, will set the file descriptors 
- * to their appropriate files.
+ * Waits for the child pid and returns its exit status
+ * A child killed by a signal returns 128 + the signal number
+*/
+int wait_status(pid_t pid) {
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) == -1) {
+        if (errno != EINTR) {
+            return 1;
+        }
+        // Interrupted, maybe by SIGUSR1 asking for the trace
+        trace_poll();
+    }
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+}
+
+/**
+ * Keeps the exit status of a background job reaped by something 
+ *      other than the shell's job report
+*/
+static void keep_finished_job(pid_t pid, int status) {
+    if (finished_count == finished_cap) {
+        int cap = (finished_cap == 0) ? 16 : finished_cap * 2;
+        pid_t *pids = realloc(finished_pids, sizeof(pid_t) * cap);
+        if (pids == NULL) {
+            return;
+        }
+        finished_pids = pids;
+        int *statuses = realloc(finished_statuses, sizeof(int) * cap);
+        if (statuses == NULL) {
+            return;
+        }
+        finished_statuses = statuses;
+        finished_cap = cap;
+    }
+    finished_pids[finished_count] = pid;
+    finished_statuses[finished_count] = status;
+    finished_count++;
+}
+
+/**
+ * Takes the oldest background job kept by keep_finished_job()
+ * Returns false once there are none left
+*/
+bool take_finished_job(pid_t *pid, int *status) {
+    if (finished_count == 0) {
+        return false;
+    }
+    *pid = finished_pids[0];
+    *status = finished_statuses[0];
+    finished_count--;
+    memmove(finished_pids, finished_pids + 1, sizeof(pid_t) * finished_count);
+    memmove(finished_statuses, finished_statuses + 1, sizeof(int) * finished_count);
+    return true;
+}
+
+/**
+ * Writes all len bytes of buf to fd, retrying on short writes
+*/
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Appends n bytes of str to the growing buffer *buf
+*/
+static void append_str(char **buf, size_t *len, size_t *cap, const char *str, size_t n) {
+    if (*len + n + 1 > *cap) {
+        while (*len + n + 1 > *cap) {
+            *cap = (*cap == 0) ? 256 : *cap * 2;
+        }
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, str, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+/**
+ * Appends line to buf, replacing $NAME and ${NAME} 
+ *      with the value of that environment variable
+ * A backslash in front of '$' keeps it literal
+*/
+static void append_expanded(char **buf, size_t *len, size_t *cap, const char *line) {
+    while (*line != '\0') {
+        if (line[0] == '\\' && line[1] == '$') {
+            append_str(buf, len, cap, "$", 1);
+            line += 2;
+        } else if (line[0] == '$' && (line[1] == '{' || line[1] == '_' || isalpha((unsigned char) line[1]))) {
+            // Pull out the variable name
+            bool braced = (line[1] == '{');
+            const char *start = line + (braced ? 2 : 1);
+            const char *end = start;
+            while (*end == '_' || isalnum((unsigned char) *end)) {
+                end++;
+            }
+            if (braced && *end != '}') {
+                // Not a valid ${NAME}, keep it as is
+                append_str(buf, len, cap, line, 1);
+                line++;
+                continue;
+            }
+
+            char name[end - start + 1];
+            memcpy(name, start, end - start);
+            name[end - start] = '\0';
+            char *value = getenv(name);
+            if (value != NULL) {
+                append_str(buf, len, cap, value, strlen(value));
+            }
+            line = braced ? end + 1 : end;
+        } else {
+            append_str(buf, len, cap, line, 1);
+            line++;
+        }
+    }
+}
+
+/**
+ * Reads the body of a here-document from source up to the line holding delim
+ * If the delimiter is quoted ('EOF', "EOF" or \EOF) expand is cleared 
+ *      and the body is used as is, otherwise environment variables 
+ *      are expanded when the command runs
  * 
- * If redirection is present, recall parse() 
- *      to execute the command with the 
- *      newly set file descriptors
+ * Returns the malloc'd body
 */
-int redirection_cmd(int argc, char *argv[]) {
-    // Status of redirection. 0 is none found. 1 is found and executed. -1 is error
-    int status = 0;
-    // Check for redirection
-    // Save stdin and stdout to reset file descriptors at the end 
-    int original_stdin = dup(0); 
-    int original_stdout = dup(1);
+char *read_heredoc(FILE *source, const char *delim, bool *expand) {
+    // Strip quoting from the delimiter
+    *expand = true;
+    size_t delim_len = strlen(delim);
+    if (delim_len >= 2 && (delim[0] == '\'' || delim[0] == '"') && delim[delim_len-1] == delim[0]) {
+        *expand = false;
+        delim++;
+        delim_len -= 2;
+    } else if (delim[0] == '\\') {
+        *expand = false;
+        delim++;
+        delim_len--;
+    }
 
-    // Create new args without redirection symbols present
-    int new_argc = 0;
-    char *new_argv[argc];
+    bool prompt = isatty(fileno(source));
+
+    char *body = NULL;
+    size_t body_len = 0;
+    size_t body_cap = 0;
+    append_str(&body, &body_len, &body_cap, "", 0);
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t n;
+    while (1) {
+        if (prompt) {
+            printf("heredoc> ");
+            fflush(stdout);
+        }
+        if ((n = getline(&line, &line_size, source)) == -1) {
+            printf("warning: here-document delimited by end-of-file.\n");
+            clearerr(source);
+            break;
+        }
+
+        // Compare against the delimiter without the line ending
+        size_t content_len = n;
+        while (content_len > 0 && (line[content_len-1] == '\n' || line[content_len-1] == '\r')) {
+            content_len--;
+        }
+        if (content_len == delim_len && strncmp(line, delim, delim_len) == 0) {
+            break;
+        }
+
+        append_str(&body, &body_len, &body_cap, line, n);
+    }
+    free(line);
 
-    
+    return body;
+}
+
+/**
+ * Sets the here-document bodies the next apply_redirections() uses, 
+ *      one for each << in order
+*/
+void use_heredocs(struct heredoc *heredocs, int count) {
+    pending_heredocs = heredocs;
+    pending_heredoc_count = count;
+}
+
+/**
+ * Returns a readable file descriptor positioned at the start of body
+ * 
+ * Bodies that fit in the pipe buffer are written into a pipe 
+ *      so the write can never block
+ * Anything larger goes into an anonymous memfd, which never 
+ *      touches the filesystem and lets the command seek or mmap stdin
+*/
+static int heredoc_fd(const char *body, size_t len) {
+    int fd[2];
+    if (pipe(fd) == -1) {
+        printf("pipe(fd) error.\n");
+        return -1;
+    }
+
+    int capacity = fcntl(fd[1], F_GETPIPE_SZ);
+    if (capacity > 0 && len <= (size_t) capacity) {
+        if (write_all(fd[1], body, len) == -1) {
+            printf("error writing here-document.\n");
+            close(fd[0]);
+            close(fd[1]);
+            return -1;
+        }
+        close(fd[1]);
+        return fd[0];
+    }
+    close(fd[0]);
+    close(fd[1]);
+
+    int mfd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (mfd == -1) {
+        printf("memfd_create() error.\n");
+        return -1;
+    }
+    if (write_all(mfd, body, len) == -1 || lseek(mfd, 0, SEEK_SET) == -1) {
+        printf("error writing here-document.\n");
+        close(mfd);
+        return -1;
+    }
+    return mfd;
+}
+
+/**
+ * Restores stdin and stdout saved by apply_redirections()
+*/
+void restore_redirections(int saved[2]) {
+    fflush(stdout);
+    for (int i = 0; i < 2; i++) {
+        if (saved[i] != -1) {
+            dup2(saved[i], i);
+            close(saved[i]);
+            saved[i] = -1;
+        }
+    }
+}
+
+/**
+ * Sets stdin and stdout to the files named by any redirection in argv
+ * The remaining arguments are copied to new_argv, which needs room for argc + 1
+ * 
+ * <<EOF reads a here-document and <<<word feeds word 
+ *      as a single line, neither creates a file on disk
+ * 
+ * The original descriptors are kept in saved for restore_redirections()
+ * Returns 0 if none found, 1 if applied, -1 on error (nothing left applied)
+*/
+int apply_redirections(int argc, char *argv[], int *new_argc, char *new_argv[], int saved[2]) {
+    // Status of redirection. 0 is none found. 1 is found and applied. -1 is error
+    int status = 0;
+    saved[0] = -1;
+    saved[1] = -1;
+    *new_argc = 0;
 
     // Loop through argv looking for redirection
     for (int i = 0; i < argc; i++) {
-        // Symbol Found
-        if (strcmp(argv[i], "<") == 0 || 
-            strcmp(argv[i], ">") == 0 || 
-            strcmp(argv[i], ">>") == 0) {
-                // Make sure a file was give
-                if (argv[i+1] != NULL) {
-                    // keep track of what modes are needed
-                    int mode; 
-
-                    // stdin 
-                    if (strcmp(argv[i], "<") == 0) {
-                        mode = O_RDONLY;
-                    // stdout that overwrite 
-                    } else if (strcmp(argv[i], ">") == 0) {
-                        mode = O_CREAT | O_WRONLY | O_TRUNC;
-                    // stdout that doesn't overwrite
-                    } else {
-                        mode = O_CREAT | O_WRONLY | O_APPEND;
-                    }
-
-                    int fd = open(argv[i+1], mode, 0666);
-                    if (fd == -1) {
-                        printf("error opening file.\n");
-                        return -1;
-                    }
-
-                    // Overwrite the appropriate file descriptor tables
-                    if (strcmp(argv[i], "<") == 0) {
-                        close(0); 
-                        int dup1 = dup(fd);
-                        if (dup1 < 0) {
-                            printf("error with dup1.\n");
-                            return -1;
-                        }
-                        close(fd);
-                        status = 0;
-                    } else {
-                        close(1); 
-                        int dup2 = dup(fd); 
-                        if (dup2 < 0) {
-                            printf("error with dup2.\n");
-                            return -1;
-                        }
-                        close(fd);
-                    }
-                // Move past redirection symbol and filename
-                status = 1;
-                i++;
-                } else {
-                    printf("no file given for redirection.\n"); 
+        bool here_doc = (strncmp(argv[i], "<<", 2) == 0);
+        bool symbol = (strcmp(argv[i], "<") == 0 || 
+                       strcmp(argv[i], ">") == 0 || 
+                       strcmp(argv[i], ">>") == 0);
+        if (!here_doc && !symbol) {
+            // No symbol found, and not a filename so add to new_argv
+            // and increment new_argc
+            new_argv[(*new_argc)++] = argv[i];
+            continue;
+        }
+
+        // Save stdin and stdout the first time one is replaced
+        if (status == 0) {
+            fflush(stdout);
+            saved[0] = dup(0);
+            saved[1] = dup(1);
+        }
+        status = 1;
+
+        int fd;
+        int target;
+        // Here-string (<<<word) or here-document (<<EOF)
+        if (here_doc) {
+            bool here_string = (strncmp(argv[i], "<<<", 3) == 0);
+            // The word may be attached to the symbol or be the next argument
+            char *word = argv[i] + (here_string ? 3 : 2);
+            if (*word == '\0') {
+                if (i + 1 >= argc) {
+                    printf("no word given for here-document.\n");
+                    restore_redirections(saved);
                     return -1;
                 }
+                word = argv[++i];
+            }
+
+            // The body was read with the line, see use_heredocs()
+            char *body = NULL;
+            size_t len = 0;
+            size_t cap = 0;
+            if (here_string) {
+                append_str(&body, &len, &cap, word, strlen(word));
+                append_str(&body, &len, &cap, "\n", 1);
+            } else if (pending_heredoc_count > 0) {
+                struct heredoc *heredoc = pending_heredocs++;
+                pending_heredoc_count--;
+                if (heredoc->expand) {
+                    append_str(&body, &len, &cap, "", 0);
+                    append_expanded(&body, &len, &cap, heredoc->body);
+                } else {
+                    append_str(&body, &len, &cap, heredoc->body, strlen(heredoc->body));
+                }
+            } else {
+                printf("no body read for here-document.\n");
+                restore_redirections(saved);
+                return -1;
+            }
+
+            fd = heredoc_fd(body, len);
+            free(body);
+            if (fd == -1) {
+                restore_redirections(saved);
+                return -1;
+            }
+            target = 0;
+        // Symbol Found
         } else {
-            // No symbol found, and not a filename so add to new_argv
-            // and increment new_argc
-            new_argv[new_argc++] = argv[i];
+            // Make sure a file was give
+            if (i + 1 >= argc) {
+                printf("no file given for redirection.\n"); 
+                restore_redirections(saved);
+                return -1;
+            }
+
+            // keep track of what modes are needed
+            int mode; 
+
+            // stdin 
+            if (strcmp(argv[i], "<") == 0) {
+                mode = O_RDONLY;
+                target = 0;
+            // stdout that overwrite 
+            } else if (strcmp(argv[i], ">") == 0) {
+                mode = O_CREAT | O_WRONLY | O_TRUNC;
+                target = 1;
+            // stdout that doesn't overwrite
+            } else {
+                mode = O_CREAT | O_WRONLY | O_APPEND;
+                target = 1;
+            }
+
+            fd = open(argv[i+1], mode, 0666);
+            if (fd == -1) {
+                printf("error opening file.\n");
+                restore_redirections(saved);
+                return -1;
+            }
+            // Move past redirection symbol and filename
+            i++;
         }
+
+        // Overwrite the appropriate file descriptor tables
+        if (dup2(fd, target) < 0) {
+            printf("error with dup%d.\n", target + 1);
+            close(fd);
+            restore_redirections(saved);
+            return -1;
+        }
+        close(fd);
     }
 
-    // Redirection found, re send new argc and argv to 
-    // parse, to run the command with the file descriptors 
-    // set to their new values
-    if (status == 1) {
-        new_argv[new_argc] = NULL;
-        parse(new_argc, new_argv);
+    new_argv[*new_argc] = NULL;
+    return status;
+}
+
+/**
+ * Checks for redirection 
+ * If present, will set the file descriptors 
+ * to their appropriate files.
+ * 
+ * If redirection is present, runs the rest of 
+ *      the command with the newly set file descriptors
+ *      and then puts them back
+*/
+int redirection_cmd(int argc, char *argv[]) {
+    // Create new args without redirection symbols present
+    int new_argc = 0;
+    char *new_argv[argc + 1];
+    int saved[2];
+
+    int status = apply_redirections(argc, argv, &new_argc, new_argv, saved);
+    if (status != 1) {
+        return status;
     }
 
-    // return file descriptor table back to normal
-    dup2(original_stdin, 0);
-    dup2(original_stdout, 1);
-    close(original_stdin);
-    close(original_stdout);
+    if (new_argc > 0) {
+        run_cmd(new_argc, new_argv);
+    }
 
+    // return file descriptor table back to normal
+    restore_redirections(saved);
     return status;
 }
 
+/**
+ * Checks if name is a builtin run_cmd() runs in the shell itself
+*/
+static bool is_builtin(const char *name) {
+    for (int i = 0; builtins[i] != NULL; i++) {
+        if (strcmp(name, builtins[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Drops the here-document bodies meant for the << in argv
+*/
+static void skip_heredocs(int argc, char *argv[]) {
+    for (int i = 0; i < argc && pending_heredoc_count > 0; i++) {
+        if (strncmp(argv[i], "<<", 2) == 0 && strncmp(argv[i], "<<<", 3) != 0) {
+            pending_heredocs++;
+            pending_heredoc_count--;
+        }
+    }
+}
+
+/**
+ * Runs one command of a pipe in its forked child, never returns
+ * Builtins go through run_cmd(), anything else is exec'd
+*/
+static void run_pipe_stage(int argc, char *argv[], int watch[2]) {
+    if (is_builtin(argv[0])) {
+        // Never exec'd, so don't keep the parent waiting for it
+        if (watch[1] != -1) {
+            close(watch[1]);
+        }
+        in_subshell = true;
+        exit_child(run_cmd(argc, argv));
+    }
+    exec_job(argv, watch);
+}
+
 /**
  * Checks for a pipe symbol
  * If found, splits argv into the two arguments, sets up the pipe
@@ -278,9 +817,15 @@ int pipe_cmd(int argc, char *argv[]) {
             printf("pipe(fd) error.\n");
             return -1;
         } else {
+            int watch[2];
+            exec_watch_open(watch);
+            fflush(stdout);
+            uint64_t start = trace_now();
             pid_t pid1 = fork(); 
             if (pid1 == -1) {
                 printf("fork() error.\n");
+                trace_instant("error", "fork() error");
+                exec_watch_close(watch);
                 return -1;
             // Child process for the first command
             } else if (pid1 == 0) {
@@ -291,12 +836,18 @@ int pipe_cmd(int argc, char *argv[]) {
                 // Close write end of pipe
                 close(fd[1]);
                 // Execute first command
-                execvp(argv1[0], argv1);
+                run_pipe_stage(argc1, argv1, watch);
             // Parent Process
             } else {
+                trace_span_argv("spawn", argc1, argv1, start);
+                exec_watch_wait(watch, argc1, argv1, trace_now());
+                exec_watch_open(watch);
+                start = trace_now();
                 pid_t pid2 = fork(); 
                 if (pid2 == -1) {
                     printf("fork() error.\n");
+                    trace_instant("error", "fork() error");
+                    exec_watch_close(watch);
                     return -1;
                 // Child process for second command
                 } else if (pid2 == 0) {
@@ -307,8 +858,12 @@ int pipe_cmd(int argc, char *argv[]) {
                     // Close input end of pipe
                     close(fd[0]);
                     // Execute the second command
-                    execvp(argv2[0], argv2);
+                    // Here-documents of the first command are its own
+                    skip_heredocs(argc1, argv1);
+                    run_pipe_stage(argc2, argv2, watch);
                 }
+                trace_span_argv("spawn", argc2, argv2, start);
+                exec_watch_wait(watch, argc2, argv2, trace_now());
 
                 // Close unused ends of pipes 
                 close(fd[0]); 
@@ -316,16 +871,343 @@ int pipe_cmd(int argc, char *argv[]) {
 
 
 
+                start = trace_now();
                 if (!run_background1) {
-                    wait(NULL);
+                    wait_status(pid1);
                 } 
+                // The pipe's exit status is the second command's
+                last_status = 0;
                 if (!run_background2) {
-                    wait(NULL);
+                    last_status = wait_status(pid2);
                 }
+                trace_span_argv("wait", argc, argv, start);
                 return status;
             }
         }
     } 
 
     return 0;
-}
\ No newline at end of file
+}
+// State of the job run for one item of parallel
+struct parallel_job {
+    pid_t pid;
+    int status;
+    // Output kept back for -k, -1 if written straight to stdout
+    int out_fd;
+    bool done;
+    uint64_t started;
+};
+
+/**
+ * Builds the command line for one item of parallel
+ * Every {} in the template is replaced by the item, if the 
+ *      template has no {} the item is added as the last argument
+ * 
+ * Arguments that had to be rewritten are malloc'd and flagged in owned
+*/
+static void build_job_argv(int template_argc, char *template_argv[], char *item, char *job_argv[], bool owned[]) {
+    bool substituted = false;
+    int job_argc = 0;
+    for (int i = 0; i < template_argc; i++) {
+        owned[job_argc] = false;
+        if (strstr(template_argv[i], "{}") == NULL) {
+            job_argv[job_argc++] = template_argv[i];
+            continue;
+        }
+
+        char *arg = NULL;
+        size_t len = 0;
+        size_t cap = 0;
+        append_str(&arg, &len, &cap, "", 0);
+        const char *rest = template_argv[i];
+        const char *marker;
+        while ((marker = strstr(rest, "{}")) != NULL) {
+            append_str(&arg, &len, &cap, rest, marker - rest);
+            append_str(&arg, &len, &cap, item, strlen(item));
+            rest = marker + 2;
+        }
+        append_str(&arg, &len, &cap, rest, strlen(rest));
+
+        owned[job_argc] = true;
+        job_argv[job_argc++] = arg;
+        substituted = true;
+    }
+
+    if (!substituted) {
+        owned[job_argc] = false;
+        job_argv[job_argc++] = item;
+    }
+    job_argv[job_argc] = NULL;
+}
+
+/**
+ * Copies everything written to a job's output file to stdout
+*/
+static void flush_job_output(int fd) {
+    char buf[65536];
+    ssize_t n;
+    fflush(stdout);
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (write_all(1, buf, n) == -1) {
+            break;
+        }
+    }
+}
+
+/**
+ * Frees the first count items read from stdin
+*/
+static void free_items(char **items, int count) {
+    for (int j = 0; j < count; j++) {
+        free(items[j]);
+    }
+    free(items);
+}
+
+/**
+ * Executes the parallel builtin
+ * 
+ * parallel [-j N] [-k] cmd args... [::: item ...]
+ * 
+ * Runs cmd once per item with up to N jobs at a time (default is 
+ *      one per core). Items come after ::: or, without it, one per line from stdin
+ * -k keeps each job's output together and prints it in input order,
+ *      when out of file descriptors for that no new jobs start until 
+ *      earlier output has been printed
+ * 
+ * Returns the number of jobs that failed, at most 101
+*/
+int parallel_cmd(int argc, char *argv[]) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool keep_order = false;
+
+    // Read options
+    int i = 1;
+    while (i < argc && argv[i][0] == '-') {
+        if (strcmp(argv[i], "-k") == 0) {
+            keep_order = true;
+            i++;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            char *value = argv[i] + 2;
+            if (*value == '\0') {
+                value = (i + 1 < argc) ? argv[++i] : "";
+            }
+            jobs = atol(value);
+            if (jobs < 1) {
+                printf("parallel: invalid number of jobs.\n");
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            printf("parallel: unknown option %s.\n", argv[i]);
+            return 1;
+        }
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    // Command template runs up to :::
+    int template_start = i;
+    while (i < argc && strcmp(argv[i], ":::") != 0) {
+        i++;
+    }
+    int template_argc = i - template_start;
+    if (template_argc == 0) {
+        printf("usage: parallel [-j N] [-k] cmd args... [::: item ...]\n");
+        return 1;
+    }
+
+    // Collect the items
+    char **items;
+    int item_count = 0;
+    bool items_from_stdin = (i == argc);
+    if (!items_from_stdin) {
+        items = &argv[i + 1];
+        item_count = argc - i - 1;
+    } else {
+        int items_cap = 64;
+        items = malloc(sizeof(char *) * items_cap);
+        char *line = NULL;
+        size_t line_size = 0;
+        ssize_t n;
+        while (items != NULL && (n = getline(&line, &line_size, stdin)) != -1) {
+            while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) {
+                line[--n] = '\0';
+            }
+            if (n == 0) {
+                continue;
+            }
+            if (item_count == items_cap) {
+                items_cap *= 2;
+                char **grown = realloc(items, sizeof(char *) * items_cap);
+                if (grown == NULL) {
+                    free_items(items, item_count);
+                    items = NULL;
+                    break;
+                }
+                items = grown;
+            }
+            if ((items[item_count] = strdup(line)) == NULL) {
+                free_items(items, item_count);
+                items = NULL;
+                break;
+            }
+            item_count++;
+        }
+        free(line);
+        clearerr(stdin);
+        if (items == NULL) {
+            printf("parallel: out of memory reading items.\n");
+            return 1;
+        }
+    }
+
+    // Never more jobs than items
+    if (jobs > item_count) {
+        jobs = item_count;
+    }
+
+    // State of every item's job, slots maps running jobs to items
+    struct parallel_job *states = calloc(item_count, sizeof(struct parallel_job));
+    int *slots = malloc(sizeof(int) * jobs);
+    if (item_count > 0 && (states == NULL || slots == NULL)) {
+        printf("parallel: out of memory.\n");
+        free(states);
+        free(slots);
+        if (items_from_stdin) {
+            free_items(items, item_count);
+        }
+        return 1;
+    }
+    for (int j = 0; j < jobs; j++) {
+        slots[j] = -1;
+    }
+
+    int next = 0;
+    int running = 0;
+    int flushed = 0;
+    int failed = 0;
+    // Set once no more jobs can be started
+    bool stopped = false;
+    while ((next < item_count && !stopped) || running > 0) {
+        // Fill every free slot from the queue
+        for (int slot = 0; slot < jobs && next < item_count && !stopped; slot++) {
+            if (slots[slot] != -1) {
+                continue;
+            }
+            int item = next;
+            states[item].out_fd = -1;
+            if (keep_order && (states[item].out_fd = memfd_create("parallel", MFD_CLOEXEC)) == -1) {
+                if (running > 0) {
+                    // Out of descriptors, wait for running jobs to hand some back
+                    break;
+                }
+                // Nothing left to wait for, the output order can't be kept
+                printf("parallel: memfd_create() error, %d items not run.\n", item_count - item);
+                failed += item_count - item;
+                stopped = true;
+                break;
+            }
+            next++;
+
+            char *job_argv[template_argc + 2];
+            bool owned[template_argc + 2];
+            build_job_argv(template_argc, &argv[template_start], items[item], job_argv, owned);
+            states[item].done = false;
+
+            int watch[2];
+            exec_watch_open(watch);
+            fflush(stdout);
+            states[item].started = trace_now();
+            pid_t pid = fork();
+            if (pid == -1) {
+                printf("fork() error.\n");
+                trace_instant("error", "fork() error");
+                exec_watch_close(watch);
+                states[item].status = -1;
+                states[item].done = true;
+            } else if (pid == 0) {
+                // Child, jobs don't share the terminal's stdin
+                int null_fd = open("/dev/null", O_RDONLY);
+                if (null_fd != -1) {
+                    dup2(null_fd, 0);
+                    close(null_fd);
+                }
+                if (states[item].out_fd != -1) {
+                    dup2(states[item].out_fd, 1);
+                }
+                exec_job(job_argv, watch);
+            } else {
+                trace_span_argv("spawn", template_argc + 1, job_argv, states[item].started);
+                exec_watch_wait(watch, template_argc + 1, job_argv, trace_now());
+                states[item].pid = pid;
+                slots[slot] = item;
+                running++;
+            }
+
+            for (int j = 0; job_argv[j] != NULL; j++) {
+                if (owned[j]) {
+                    free(job_argv[j]);
+                }
+            }
+        }
+
+        // Reap the next job that finishes
+        if (running > 0) {
+            int wstatus;
+            pid_t pid = waitpid(-1, &wstatus, 0);
+            if (pid == -1) {
+                if (errno == EINTR) {
+                    trace_poll();
+                    continue;
+                }
+                printf("waitpid() error.\n");
+                break;
+            }
+            int exit_status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+            bool ours = false;
+            for (int slot = 0; slot < jobs; slot++) {
+                if (slots[slot] != -1 && states[slots[slot]].pid == pid) {
+                    int item = slots[slot];
+                    states[item].status = exit_status;
+                    trace_span("job", items[item], states[item].started);
+                    states[item].done = true;
+                    slots[slot] = -1;
+                    running--;
+                    ours = true;
+                    break;
+                }
+            }
+            if (!ours) {
+                // An earlier background job, leave it for the job report
+                keep_finished_job(pid, exit_status);
+            }
+        }
+
+        // Print the output of finished jobs in input order
+        while (flushed < next && states[flushed].done) {
+            if (states[flushed].out_fd != -1) {
+                flush_job_output(states[flushed].out_fd);
+                close(states[flushed].out_fd);
+            }
+            if (states[flushed].status != 0) {
+                printf("parallel: %s: exit status %d.\n", items[flushed], states[flushed].status);
+                failed++;
+            }
+            flushed++;
+        }
+    }
+
+    free(states);
+    free(slots);
+    if (items_from_stdin) {
+        free_items(items, item_count);
+    }
+
+    return (failed > 101) ? 101 : failed;
+}
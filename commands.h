@@ -6,11 +6,43 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct cmd_tree;
+
+// Body of a here-document, read while its command line is parsed
+struct heredoc {
+    char *body;
+    // Environment variables in the body are expanded when it is used
+    bool expand;
+};
+
+// Where here-document bodies are read from, stdin when NULL
+extern FILE *heredoc_input;
+
+// Exit status of the last command run
+extern int last_status;
+
+// Set in a forked subshell, which has to leave with _exit()
+extern bool in_subshell;
+
 void parse(int argc, char *argv[]);
-void exit_cmd(int argc, char *argv[]);
-void cd_cmd(int argc, char *argv[]);
-void simple_cmd(int argc, char *argv[]);
+void run_parsed(struct cmd_tree *tree, int argc, char *argv[]);
+int run_cmd(int argc, char *argv[]);
+int exit_cmd(int argc, char *argv[]);
+void exit_child(int status);
+int cd_cmd(int argc, char *argv[]);
+int simple_cmd(int argc, char *argv[]);
+int wait_status(pid_t pid);
+char *read_heredoc(FILE *source, const char *delim, bool *expand);
+void use_heredocs(struct heredoc *heredocs, int count);
+bool take_finished_job(pid_t *pid, int *status);
+int apply_redirections(int argc, char *argv[], int *new_argc, char *new_argv[], int saved[2]);
+void restore_redirections(int saved[2]);
 int redirection_cmd(int argc, char *argv[]);
 int pipe_cmd(int argc, char *argv[]);
+int parallel_cmd(int argc, char *argv[]);
 
-#endif
\ No newline at end of file
+#endif
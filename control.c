@@ -0,0 +1,542 @@
+/**
+ * Implementation File for command lists and conditionals
+ *
+ * Splits ;, &&, ||, ( and ) out of the words of a command line,
+ *      parses the whole line into one tree and runs it
+ * Single commands in the tree are run by run_cmd()
+ *
+ * @author Sam Kapp
+*/
+#include "control.h"
+#include "commands.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Builtins that change the shell itself, a subshell running one has to fork
+static const char *state_builtins[] = {"cd", "exit", "ulimit", "trace", NULL};
+
+struct parser {
+    char **tokens;
+    int count;
+    int pos;
+    // Set when the last command ended in '&'
+    bool background;
+    bool error;
+    // Don't print syntax errors
+    bool quiet;
+};
+
+static struct node *parse_list(struct parser *p, const char *closer);
+
+/**
+ * Checks if token separates commands
+*/
+static bool is_operator(const char *token) {
+    return strcmp(token, ";") == 0 || strcmp(token, "&&") == 0 ||
+           strcmp(token, "||") == 0 || strcmp(token, "(") == 0 ||
+           strcmp(token, ")") == 0;
+}
+
+/**
+ * Returns the operator at the start of s, or NULL if there is none
+*/
+static const char *operator_at(const char *s) {
+    if (strncmp(s, "&&", 2) == 0) {
+        return "&&";
+    } else if (strncmp(s, "||", 2) == 0) {
+        return "||";
+    } else if (*s == ';') {
+        return ";";
+    } else if (*s == '(') {
+        return "(";
+    } else if (*s == ')') {
+        return ")";
+    }
+    return NULL;
+}
+
+/**
+ * Adds a token to the tree
+*/
+static void add_token(struct cmd_tree *tree, char *token, bool owned) {
+    tree->tokens[tree->token_count] = token;
+    tree->owned[tree->token_count] = owned;
+    tree->token_count++;
+}
+
+/**
+ * Splits operators out of each word, so "ls;pwd" becomes "ls" ";" "pwd"
+ * Nothing inside quotes is split
+ * Words without operators are used as they are
+*/
+static void split_tokens(struct cmd_tree *tree, int argc, char *argv[]) {
+    for (int i = 0; i < argc; i++) {
+        char *word = argv[i];
+        if (strpbrk(word, ";&|()") == NULL) {
+            add_token(tree, word, false);
+            continue;
+        }
+
+        const char *start = word;
+        const char *s = word;
+        char quote = '\0';
+        while (*s != '\0') {
+            const char *op = NULL;
+            if (quote != '\0') {
+                if (*s == quote) {
+                    quote = '\0';
+                }
+            } else if (*s == '"' || *s == '\'') {
+                quote = *s;
+            } else {
+                op = operator_at(s);
+            }
+
+            if (op == NULL) {
+                s++;
+                continue;
+            }
+            if (s > start) {
+                add_token(tree, strndup(start, s - start), true);
+            }
+            add_token(tree, (char *) op, false);
+            s += strlen(op);
+            start = s;
+        }
+
+        if (start == word) {
+            add_token(tree, word, false);
+        } else if (*start != '\0') {
+            add_token(tree, strdup(start), true);
+        }
+    }
+}
+
+/**
+ * Allocates a node with its argv copied from count tokens starting at first
+*/
+static struct node *new_node(struct parser *p, enum node_type type, int first, int count) {
+    struct node *node = calloc(1, sizeof(struct node));
+    node->type = type;
+    node->argc = count;
+    node->first = first;
+    node->argv = malloc(sizeof(char *) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        node->argv[i] = p->tokens[first + i];
+    }
+    node->argv[count] = NULL;
+    return node;
+}
+
+/**
+ * Frees a node and everything under it
+*/
+static void free_node(struct node *node) {
+    if (node == NULL) {
+        return;
+    }
+    free_node(node->left);
+    free_node(node->right);
+    free_node(node->body);
+    for (int i = 0; i < node->heredoc_count; i++) {
+        free(node->heredocs[i].body);
+    }
+    free(node->heredocs);
+    free(node->argv);
+    free(node);
+}
+
+/**
+ * Prints a syntax error for the current token
+*/
+static void syntax_error(struct parser *p) {
+    if (!p->error && !p->quiet) {
+        if (p->pos < p->count) {
+            printf("syntax error near '%s'.\n", p->tokens[p->pos]);
+        } else {
+            printf("syntax error: unexpected end of line.\n");
+        }
+    }
+    p->error = true;
+}
+
+/**
+ * Parses a single command, subshell or group
+*/
+static struct node *parse_command(struct parser *p) {
+    p->background = false;
+    if (p->pos >= p->count) {
+        syntax_error(p);
+        return NULL;
+    }
+
+    char *token = p->tokens[p->pos];
+    bool subshell = (strcmp(token, "(") == 0);
+    bool group = (strcmp(token, "{") == 0);
+    if (subshell || group) {
+        const char *closer = subshell ? ")" : "}";
+        p->pos++;
+        struct node *body = parse_list(p, closer);
+        if (body == NULL || p->pos >= p->count || strcmp(p->tokens[p->pos], closer) != 0) {
+            syntax_error(p);
+            free_node(body);
+            return NULL;
+        }
+        p->pos++;
+
+        // Anything up to the next operator is a redirection for the whole body,
+        // a '&' ends it and runs the whole body in the background
+        int start = p->pos;
+        while (p->pos < p->count && !is_operator(p->tokens[p->pos]) &&
+               strcmp(p->tokens[p->pos], "&") != 0) {
+            p->pos++;
+        }
+        struct node *node = new_node(p, subshell ? NODE_SUBSHELL : NODE_GROUP, start, p->pos - start);
+        node->body = body;
+        if (p->pos < p->count && strcmp(p->tokens[p->pos], "&") == 0) {
+            p->pos++;
+            node->background = true;
+            p->background = true;
+        }
+        return node;
+    }
+
+    if (is_operator(token)) {
+        syntax_error(p);
+        return NULL;
+    }
+
+    // Plain command, a '&' ends it and stays as its last word
+    int start = p->pos;
+    while (p->pos < p->count && !is_operator(p->tokens[p->pos])) {
+        if (strcmp(p->tokens[p->pos++], "&") == 0) {
+            p->background = true;
+            break;
+        }
+    }
+    return new_node(p, NODE_CMD, start, p->pos - start);
+}
+
+/**
+ * Parses commands joined by && and ||
+*/
+static struct node *parse_and_or(struct parser *p) {
+    struct node *left = parse_command(p);
+    while (left != NULL && !p->background && p->pos < p->count) {
+        enum node_type type;
+        if (strcmp(p->tokens[p->pos], "&&") == 0) {
+            type = NODE_AND;
+        } else if (strcmp(p->tokens[p->pos], "||") == 0) {
+            type = NODE_OR;
+        } else {
+            break;
+        }
+        p->pos++;
+
+        struct node *right = parse_command(p);
+        if (right == NULL) {
+            free_node(left);
+            return NULL;
+        }
+        struct node *node = calloc(1, sizeof(struct node));
+        node->type = type;
+        node->left = left;
+        node->right = right;
+        left = node;
+    }
+    return left;
+}
+
+/**
+ * Parses commands separated by ; or &, up to closer or the end of the line
+*/
+static struct node *parse_list(struct parser *p, const char *closer) {
+    struct node *left = parse_and_or(p);
+    while (left != NULL && p->pos < p->count) {
+        if (strcmp(p->tokens[p->pos], ";") == 0) {
+            p->pos++;
+        } else if (!p->background) {
+            break;
+        }
+
+        // A trailing separator ends the list
+        if (p->pos >= p->count || (closer != NULL && strcmp(p->tokens[p->pos], closer) == 0)) {
+            break;
+        }
+
+        struct node *right = parse_and_or(p);
+        if (right == NULL) {
+            free_node(left);
+            return NULL;
+        }
+        struct node *node = calloc(1, sizeof(struct node));
+        node->type = NODE_SEQ;
+        node->left = left;
+        node->right = right;
+        left = node;
+    }
+    return left;
+}
+
+/**
+ * Parses a whole command line into a tree, NULL on a syntax error
+*/
+static struct cmd_tree *parse_line(int argc, char *argv[], bool quiet) {
+    struct cmd_tree *tree = calloc(1, sizeof(struct cmd_tree));
+
+    // Every character can at most become its own token
+    int max_tokens = 0;
+    for (int i = 0; i < argc; i++) {
+        max_tokens += strlen(argv[i]);
+    }
+    tree->tokens = malloc(sizeof(char *) * (max_tokens + 1));
+    tree->owned = malloc(sizeof(bool) * (max_tokens + 1));
+    split_tokens(tree, argc, argv);
+
+    struct parser p = {tree->tokens, tree->token_count, 0, false, false, quiet};
+    tree->root = parse_list(&p, NULL);
+    if (tree->root != NULL && p.pos < p.count) {
+        // Stopped early on an unmatched ')' or '}'
+        syntax_error(&p);
+    }
+    if (tree->root == NULL || p.error) {
+        free_tree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+/**
+ * Takes argc and argv of a whole command line and parses it into a tree
+ * Returns NULL (after printing why) if the line has a syntax error
+*/
+struct cmd_tree *build_tree(int argc, char *argv[]) {
+    return parse_line(argc, argv, false);
+}
+
+/**
+ * Same as build_tree(), but returns NULL on a syntax error without printing it
+*/
+struct cmd_tree *build_tree_quiet(int argc, char *argv[]) {
+    return parse_line(argc, argv, true);
+}
+
+/**
+ * Reads the bodies of the here-documents in node and everything under it,
+ *      in the order they appear on the line
+*/
+static void read_node_heredocs(struct node *node, FILE *source) {
+    if (node == NULL) {
+        return;
+    }
+    read_node_heredocs(node->left, source);
+    read_node_heredocs(node->right, source);
+    // A subshell's own redirections come after its body
+    read_node_heredocs(node->body, source);
+
+    for (int i = 0; i < node->argc; i++) {
+        if (strncmp(node->argv[i], "<<", 2) != 0 || strncmp(node->argv[i], "<<<", 3) == 0) {
+            continue;
+        }
+        // The word may be attached to the symbol or be the next argument
+        char *word = node->argv[i] + 2;
+        if (*word == '\0' && i + 1 < node->argc) {
+            word = node->argv[++i];
+        }
+        if (*word == '\0') {
+            // Reported when the command runs
+            continue;
+        }
+
+        struct heredoc *heredocs = realloc(node->heredocs, sizeof(struct heredoc) * (node->heredoc_count + 1));
+        if (heredocs == NULL) {
+            return;
+        }
+        node->heredocs = heredocs;
+        struct heredoc *heredoc = &node->heredocs[node->heredoc_count++];
+        heredoc->body = read_heredoc(source, word, &heredoc->expand);
+    }
+}
+
+/**
+ * Reads every here-document body of a parsed line from source
+ * Has to be called before the line runs, even if some commands never do
+*/
+void read_heredocs(struct cmd_tree *tree, FILE *source) {
+    read_node_heredocs(tree->root, source);
+}
+
+/**
+ * Returns the word run_cmd() ends up running for argv, 
+ *      past any redirections and limit prefixes
+ * Returns NULL if there is none or the command is a pipe, 
+ *      whose stages all run in children
+*/
+static const char *command_word(int argc, char *argv[]) {
+    const char *word = NULL;
+    int i = 0;
+    while (i < argc) {
+        if (strcmp(argv[i], "|") == 0) {
+            return NULL;
+        }
+        if (word != NULL) {
+            i++;
+        } else if (strcmp(argv[i], "<") == 0 || strcmp(argv[i], ">") == 0 ||
+                   strcmp(argv[i], ">>") == 0 || strcmp(argv[i], "<<") == 0 ||
+                   strcmp(argv[i], "<<<") == 0) {
+            // Symbol and its word
+            i += 2;
+        } else if (strncmp(argv[i], "<<", 2) == 0) {
+            // Word attached to the symbol
+            i++;
+        } else if (strcmp(argv[i], "limit") == 0) {
+            // Every option takes a value
+            i++;
+            while (i < argc && argv[i][0] == '-') {
+                if (strcmp(argv[i++], "--") == 0) {
+                    break;
+                }
+                i++;
+            }
+        } else {
+            word = argv[i++];
+        }
+    }
+    return word;
+}
+
+/**
+ * Checks if anything in node runs a builtin that changes the shell
+*/
+static bool changes_shell(struct node *node) {
+    if (node == NULL) {
+        return false;
+    }
+    if (node->type == NODE_CMD) {
+        const char *word = command_word(node->argc, node->argv);
+        for (int i = 0; word != NULL && state_builtins[i] != NULL; i++) {
+            if (strcmp(word, state_builtins[i]) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return changes_shell(node->left) || changes_shell(node->right) || changes_shell(node->body);
+}
+
+static int run_node(struct node *node);
+
+/**
+ * Runs the body of a subshell or group with its redirections
+ *
+ * Groups always run in the shell itself
+ * Subshells only fork when their body would change the shell (cd, exit, ulimit, trace),
+ *      otherwise every command in them forks anyway
+ * Either one ending in '&' forks and isn't waited for
+*/
+static int run_compound(struct node *node) {
+    int saved[2] = {-1, -1};
+    if (node->argc > 0) {
+        int new_argc;
+        char *new_argv[node->argc + 1];
+        use_heredocs(node->heredocs, node->heredoc_count);
+        int result = apply_redirections(node->argc, node->argv, &new_argc, new_argv, saved);
+        use_heredocs(NULL, 0);
+        if (result == -1) {
+            return 1;
+        }
+        if (new_argc > 0) {
+            printf("syntax error near '%s'.\n", new_argv[0]);
+            restore_redirections(saved);
+            return 2;
+        }
+    }
+
+    int status;
+    pid_t background_pid = -1;
+    if (node->background || (node->type == NODE_SUBSHELL && changes_shell(node->body))) {
+        fflush(stdout);
+        uint64_t start = trace_now();
+        pid_t pid = fork();
+        if (pid == -1) {
+            printf("fork() error.\n");
+            trace_instant("error", "fork() error");
+            status = 1;
+        } else if (pid == 0) {
+            // Child, runs the body and exits with its status
+            in_subshell = true;
+            exit_child(run_node(node->body));
+        } else if (node->background) {
+            trace_span("spawn", "( subshell ) &", start);
+            background_pid = pid;
+            status = 0;
+        } else {
+            trace_span("spawn", "( subshell )", start);
+            start = trace_now();
+            status = wait_status(pid);
+            trace_span("wait", "( subshell )", start);
+        }
+    } else {
+        status = run_node(node->body);
+    }
+
+    restore_redirections(saved);
+    if (background_pid != -1) {
+        printf("Background Process: %d\n", background_pid);
+    }
+    return status;
+}
+
+/**
+ * Runs a node of the tree and returns its exit status
+*/
+static int run_node(struct node *node) {
+    int status;
+    switch (node->type) {
+        case NODE_CMD:
+            use_heredocs(node->heredocs, node->heredoc_count);
+            status = run_cmd(node->argc, node->argv);
+            use_heredocs(NULL, 0);
+            return status;
+        case NODE_SEQ:
+            run_node(node->left);
+            return run_node(node->right);
+        case NODE_AND:
+            status = run_node(node->left);
+            return (status == 0) ? run_node(node->right) : status;
+        case NODE_OR:
+            status = run_node(node->left);
+            return (status != 0) ? run_node(node->right) : status;
+        case NODE_SUBSHELL:
+        case NODE_GROUP:
+            last_status = run_compound(node);
+            return last_status;
+    }
+    return 0;
+}
+
+/**
+ * Runs a parsed command line
+ * Returns the exit status of the last command run
+*/
+int run_tree(struct cmd_tree *tree) {
+    return run_node(tree->root);
+}
+
+/**
+ * Frees a tree built by build_tree()
+*/
+void free_tree(struct cmd_tree *tree) {
+    free_node(tree->root);
+    for (int i = 0; i < tree->token_count; i++) {
+        if (tree->owned[i]) {
+            free(tree->tokens[i]);
+        }
+    }
+    free(tree->tokens);
+    free(tree->owned);
+    free(tree);
+}
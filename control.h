@@ -0,0 +1,68 @@
+/**
+ * Header file for command lists and conditionals
+ *
+ * A command line is parsed once into a tree:
+ *      a ; b       run a then b
+ *      a & b       run a in the background then b
+ *      a && b      run b only if a succeeded
+ *      a || b      run b only if a failed
+ *      ( a )       run a in a subshell
+ *      { a ; }     run a as a group in the shell itself
+ *      ( a ) &     run a subshell or group in the background
+ *
+ * Here-document bodies follow the line in the order their << appear
+ *      and are all read with the line, whether or not their command runs
+ *
+ * @author Sam Kapp
+*/
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+struct heredoc;
+
+enum node_type {
+    NODE_CMD,
+    NODE_SEQ,
+    NODE_AND,
+    NODE_OR,
+    NODE_SUBSHELL,
+    NODE_GROUP
+};
+
+struct node {
+    enum node_type type;
+    // Sides of a list or conditional
+    struct node *left;
+    struct node *right;
+    // Body of a subshell or group
+    struct node *body;
+    // Words of a command, or the redirections of a subshell or group
+    int argc;
+    char **argv;
+    // Index of argv[0] in the tree's tokens
+    int first;
+    // Bodies of the here-documents in argv, in order
+    struct heredoc *heredocs;
+    int heredoc_count;
+    // Subshell or group ended in '&', runs in a forked child
+    bool background;
+};
+
+struct cmd_tree {
+    struct node *root;
+    // Words split out of argv, owned[i] is set if tokens[i] was allocated
+    char **tokens;
+    bool *owned;
+    int token_count;
+};
+
+struct cmd_tree *build_tree(int argc, char *argv[]);
+struct cmd_tree *build_tree_quiet(int argc, char *argv[]);
+void read_heredocs(struct cmd_tree *tree, FILE *source);
+int run_tree(struct cmd_tree *tree);
+void free_tree(struct cmd_tree *tree);
+
+#endif
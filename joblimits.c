@@ -0,0 +1,343 @@
+/**
+ * Implementation File for job resource limits
+ *
+ * Handles the ulimit and limit builtins and the batch mode default limits
+ *
+ * @author Sam Kapp
+*/
+#include "joblimits.h"
+#include "commands.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+// ioprio_set() has no glibc wrapper
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+// Applied to every job in batch mode
+static struct job_limits batch_limits = {0};
+// Applied to the command run by limit
+static struct job_limits prefix_limits = {0};
+
+/**
+ * Reads a limit value, "unlimited" is RLIM_INFINITY
+ * scale turns the value into the unit setrlimit() wants
+*/
+static int parse_rlim(const char *value, rlim_t scale, rlim_t *result) {
+    if (strcmp(value, "unlimited") == 0) {
+        *result = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+        return -1;
+    }
+    *result = (rlim_t) n * scale;
+    return 0;
+}
+
+/**
+ * Reads an I/O class like "idle" or "be:4"
+*/
+static int parse_io(const char *value, int *io_class, int *io_level) {
+    const char *names[] = {"rt", "be", "idle"};
+    *io_level = 4;
+    for (int i = 0; i < 3; i++) {
+        size_t len = strlen(names[i]);
+        if (strncmp(value, names[i], len) == 0 && (value[len] == '\0' || value[len] == ':')) {
+            *io_class = i + 1;
+            if (value[len] == ':') {
+                char *end;
+                *io_level = strtol(value + len + 1, &end, 10);
+                if (*end != '\0' || *io_level < 0 || *io_level > 7) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Reads one option of limit (or $SHELL_BATCH_LIMITS) into limits
+ * Returns -1 if the option or its value is invalid
+*/
+static int parse_limit_option(struct job_limits *limits, const char *option, const char *value) {
+    if (value == NULL) {
+        return -1;
+    }
+    if (strcmp(option, "-t") == 0) {
+        limits->set |= LIMIT_CPU;
+        return parse_rlim(value, 1, &limits->cpu);
+    } else if (strcmp(option, "-v") == 0) {
+        limits->set |= LIMIT_AS;
+        return parse_rlim(value, 1024, &limits->address_space);
+    } else if (strcmp(option, "-n") == 0) {
+        limits->set |= LIMIT_NOFILE;
+        return parse_rlim(value, 1, &limits->open_files);
+    } else if (strcmp(option, "-N") == 0) {
+        char *end;
+        limits->set |= LIMIT_NICE;
+        limits->nice = strtol(value, &end, 10);
+        return (*end == '\0' && end != value) ? 0 : -1;
+    } else if (strcmp(option, "-i") == 0) {
+        limits->set |= LIMIT_IO;
+        return parse_io(value, &limits->io_class, &limits->io_level);
+    }
+    return -1;
+}
+
+/**
+ * Reads the batch mode default limits from $SHELL_BATCH_LIMITS
+ * Returns -1 (and applies nothing) if they are invalid
+*/
+int load_batch_limits() {
+    clear_batch_limits();
+    char *policy = getenv("SHELL_BATCH_LIMITS");
+    if (policy == NULL) {
+        return 0;
+    }
+
+    char *copy = strdup(policy);
+    struct job_limits limits = {0};
+    int status = 0;
+    char *option = strtok(copy, " \t");
+    while (option != NULL) {
+        char *value = strtok(NULL, " \t");
+        if (parse_limit_option(&limits, option, value) != 0) {
+            printf("Error: invalid SHELL_BATCH_LIMITS near %s.\n", option);
+            status = -1;
+            break;
+        }
+        option = strtok(NULL, " \t");
+    }
+    free(copy);
+
+    if (status == 0) {
+        batch_limits = limits;
+    }
+    return status;
+}
+
+/**
+ * Stops applying the batch mode default limits
+*/
+void clear_batch_limits() {
+    memset(&batch_limits, 0, sizeof(batch_limits));
+}
+
+/**
+ * Sets both the soft and hard limit of resource, so the job can't raise it
+*/
+static int set_limit(int resource, rlim_t value, const char *name) {
+    struct rlimit limit;
+    getrlimit(resource, &limit);
+    if (limit.rlim_max != RLIM_INFINITY && (value == RLIM_INFINITY || value > limit.rlim_max)) {
+        // Can't go past the hard limit, keep it
+        value = limit.rlim_max;
+    }
+    limit.rlim_cur = value;
+    limit.rlim_max = value;
+    if (setrlimit(resource, &limit) != 0) {
+        printf("limit: unable to set %s limit.\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Applies one set of limits to the current process
+*/
+static int apply_limits(const struct job_limits *limits) {
+    if ((limits->set & LIMIT_CPU) && set_limit(RLIMIT_CPU, limits->cpu, "cpu") != 0) {
+        return -1;
+    }
+    if ((limits->set & LIMIT_AS) && set_limit(RLIMIT_AS, limits->address_space, "memory") != 0) {
+        return -1;
+    }
+    if ((limits->set & LIMIT_NOFILE) && set_limit(RLIMIT_NOFILE, limits->open_files, "open files") != 0) {
+        return -1;
+    }
+    if ((limits->set & LIMIT_NICE) && setpriority(PRIO_PROCESS, 0, limits->nice) != 0) {
+        printf("limit: unable to set nice value.\n");
+        return -1;
+    }
+    if (limits->set & LIMIT_IO) {
+        int ioprio = (limits->io_class << IOPRIO_CLASS_SHIFT) | limits->io_level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0) {
+            printf("limit: unable to set I/O priority.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copies every limit set in from over the same limit in into
+*/
+static void merge_limits(struct job_limits *into, const struct job_limits *from) {
+    if (from->set & LIMIT_CPU) {
+        into->cpu = from->cpu;
+    }
+    if (from->set & LIMIT_AS) {
+        into->address_space = from->address_space;
+    }
+    if (from->set & LIMIT_NOFILE) {
+        into->open_files = from->open_files;
+    }
+    if (from->set & LIMIT_NICE) {
+        into->nice = from->nice;
+    }
+    if (from->set & LIMIT_IO) {
+        into->io_class = from->io_class;
+        into->io_level = from->io_level;
+    }
+    into->set |= from->set;
+}
+
+/**
+ * Applies the batch default limits with any limit prefix over them
+ * Called in the child between fork and exec
+ *
+ * Both are merged and applied once, since each limit is applied as a 
+ *      hard limit a prefix applied after the batch limits could only lower them
+ *
+ * Returns -1 if a limit couldn't be set, the job should not run then
+*/
+int apply_job_limits() {
+    if (batch_limits.set == 0 && prefix_limits.set == 0) {
+        return 0;
+    }
+    struct job_limits limits = batch_limits;
+    merge_limits(&limits, &prefix_limits);
+    if (apply_limits(&limits) != 0) {
+        fflush(stdout);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Prints one limit of the shell for ulimit
+ * Without a description only the value is printed
+*/
+static void print_limit(const char *description, const char *option, int resource, rlim_t scale) {
+    struct rlimit limit;
+    getrlimit(resource, &limit);
+    if (description != NULL) {
+        printf("%-26s(%s) ", description, option);
+    }
+    if (limit.rlim_cur == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long) (limit.rlim_cur / scale));
+    }
+}
+
+/**
+ * Executes the ulimit builtin, which changes the soft limits of the shell
+ *      and so of every job started after it
+ *
+ * ulimit [-a] [-t seconds] [-v kbytes] [-n files]
+ * An option without a value prints that limit, no options prints -v
+ * Limits are labelled only when more than one is asked for, like bash
+*/
+int ulimit_cmd(int argc, char *argv[]) {
+    if (argc == 1) {
+        print_limit(NULL, "-v", RLIMIT_AS, 1024);
+        return 0;
+    }
+
+    int options = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            options++;
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        int resource;
+        rlim_t scale = 1;
+        const char *description;
+        if (strcmp(argv[i], "-a") == 0) {
+            print_limit("cpu time (seconds)", "-t", RLIMIT_CPU, 1);
+            print_limit("virtual memory (kbytes)", "-v", RLIMIT_AS, 1024);
+            print_limit("open files", "-n", RLIMIT_NOFILE, 1);
+            continue;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            resource = RLIMIT_CPU;
+            description = "cpu time (seconds)";
+        } else if (strcmp(argv[i], "-v") == 0) {
+            resource = RLIMIT_AS;
+            scale = 1024;
+            description = "virtual memory (kbytes)";
+        } else if (strcmp(argv[i], "-n") == 0) {
+            resource = RLIMIT_NOFILE;
+            description = "open files";
+        } else {
+            printf("usage: ulimit [-a] [-t seconds] [-v kbytes] [-n files]\n");
+            return 1;
+        }
+
+        // No value, print the limit
+        if (i + 1 >= argc || argv[i+1][0] == '-') {
+            print_limit((options > 1) ? description : NULL, argv[i], resource, scale);
+            continue;
+        }
+
+        rlim_t value;
+        if (parse_rlim(argv[++i], scale, &value) != 0) {
+            printf("ulimit: invalid limit %s.\n", argv[i]);
+            return 1;
+        }
+        struct rlimit limit;
+        getrlimit(resource, &limit);
+        limit.rlim_cur = value;
+        if (setrlimit(resource, &limit) != 0) {
+            printf("ulimit: unable to set limit, hard limit is lower.\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Executes the limit prefix, running one command with its own limits
+ *
+ * limit [-t seconds] [-v kbytes] [-n files] [-N nice] [-i rt|be|idle[:level]] cmd args...
+*/
+int limit_cmd(int argc, char *argv[]) {
+    struct job_limits limits = {0};
+    int i = 1;
+    while (i < argc && argv[i][0] == '-') {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (parse_limit_option(&limits, argv[i], (i + 1 < argc) ? argv[i+1] : NULL) != 0) {
+            printf("limit: invalid option %s.\n", argv[i]);
+            return 1;
+        }
+        i += 2;
+    }
+    if (i >= argc) {
+        printf("usage: limit [-t seconds] [-v kbytes] [-n files] [-N nice] [-i rt|be|idle[:level]] cmd args...\n");
+        return 1;
+    }
+
+    // Limits nest, so keep the outer ones to put back
+    struct job_limits outer = prefix_limits;
+    merge_limits(&prefix_limits, &limits);
+
+    int status = run_cmd(argc - i, &argv[i]);
+
+    prefix_limits = outer;
+    return status;
+}
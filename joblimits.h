@@ -0,0 +1,46 @@
+/**
+ * Header file for job resource limits
+ *
+ * ulimit changes the limits of the shell itself, which every later
+ *      job inherits
+ * limit runs a single command with its own limits:
+ *      limit -t 60 -v 2097152 -N 10 -i idle sort big.txt > sorted.txt
+ * In batch mode $SHELL_BATCH_LIMITS (same options as limit) is applied
+ *      to every job, limit on a line overrides it
+ *
+ * Job limits are applied in the child between fork and exec
+ *
+ * @author Sam Kapp
+*/
+#ifndef JOBLIMITS_H
+#define JOBLIMITS_H
+
+#include <sys/resource.h>
+
+// Which limits of a job_limits are set
+#define LIMIT_CPU 1
+#define LIMIT_AS 2
+#define LIMIT_NOFILE 4
+#define LIMIT_NICE 8
+#define LIMIT_IO 16
+
+struct job_limits {
+    int set;
+    // CPU seconds
+    rlim_t cpu;
+    // Address space in bytes
+    rlim_t address_space;
+    rlim_t open_files;
+    int nice;
+    // I/O scheduling class (1 realtime, 2 best-effort, 3 idle) and level 0-7
+    int io_class;
+    int io_level;
+};
+
+int load_batch_limits();
+void clear_batch_limits();
+int apply_job_limits();
+int ulimit_cmd(int argc, char *argv[]);
+int limit_cmd(int argc, char *argv[]);
+
+#endif
@@ -9,10 +9,23 @@
  * 
  * Shell can execute any basic commands, along with cd and exit
  * 
+ * Batch files can be compiled once with -C (./shell -C files.bat), 
+ *      later runs reuse the parsed commands in files.bat.bc until the file changes
+ * 
  * Shell also keeps track of the users command history and allows them 
  *      to arrow key through the history list 
  * 
  * Shell has an autocomplete feature, which is turned on/off with ctrl+c
+ * 
+ * While waiting for a key the shell sleeps in epoll on the terminal, 
+ *      a signalfd (SIGCHLD, SIGWINCH, SIGINT) and a timerfd, so finished 
+ *      background jobs are reported right away and the line is redrawn on resize
+ * 
+ * In batch mode every job gets the limits in $SHELL_BATCH_LIMITS 
+ *      (ex: "-t 600 -v 4194304 -N 10"), see joblimits.h
+ * 
+ * -x traces every command and writes a Chrome trace (shell_trace.json) 
+ *      on exit, on SIGUSR1 or with trace dump
  *  
  * Note: exit command just sometimes doesn't work and i'm not sure why
  *          sometimes just running the command again will get it to work
@@ -35,6 +48,9 @@
  * @author Sam Kapp
 */
 #include "commands.h" 
+#include "batch_cache.h"
+#include "trace.h"
+#include "joblimits.h"
 #include <stdio.h> 
 #include <stdlib.h> 
 #include <string.h> 
@@ -45,6 +61,10 @@
 #include <stdbool.h>
 #include <termios.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 void display();
 void sig_handler(int signo);
@@ -52,6 +72,7 @@ void sig_handler(int signo);
 // Different Mode prototypes and variable
 void interactive_mode();
 void batch_mode();
+void compiled_batch_mode(const char *path);
 FILE *batch_file = NULL;
 
 // Key press functions / struct / prototypes
@@ -62,10 +83,33 @@ char getch_(int echo);
 char getch();
 char getche();
 
+// Event loop variables and prototypes
+// How long to wait for the rest of an escape sequence
+#define ESCAPE_TIMEOUT_MS 50
+// Returned by read_key() when the timeout runs out
+#define KEY_TIMEOUT -2
+int epoll_fd = -1;
+int signal_fd = -1;
+int timer_fd = -1;
+sigset_t loop_signals;
+sigset_t saved_mask;
+// Line being edited, redrawn after job reports and resizes
+char *line_buffer = NULL;
+int *line_length = NULL;
+void events_init();
+void begin_input();
+void end_input();
+int read_key(int timeout_ms);
+void handle_signals();
+void reap_jobs();
+void print_prompt();
+void redraw_line();
+
 // History variables and prototypes
 char *history[10000];
 int history_size = -1; 
 int history_index;
+void add_history(const char *line, size_t length);
 void display_history();
 int max(int x, int y);
 
@@ -78,13 +122,28 @@ int main(int s_argc, char *s_argv[]) {
 
     display();
 
+    // Check for options
+    bool compile = false;
+    int arg = 1;
+    while (arg < s_argc && s_argv[arg][0] == '-') {
+        if (strcmp(s_argv[arg], "-C") == 0) {
+            compile = true;
+        } else if (strcmp(s_argv[arg], "-x") == 0) {
+            trace_start();
+        } else {
+            printf("Error: unknown option %s.\n", s_argv[arg]);
+            return -1;
+        }
+        arg++;
+    }
+
     // Check if batch mode 
     bool batch = false; 
-    if (s_argc > 1) {
+    if (s_argc - arg > 0) {
         // Only accept one batch file argument
-        if (s_argc == 2) {
+        if (s_argc - arg == 1) {
             batch = true;
-            batch_file = fopen(s_argv[1], "r");
+            batch_file = fopen(s_argv[arg], "r");
             if (!batch_file) {
                 printf("Error: unable to open batch file.\n");
                 return -1;
@@ -95,7 +154,9 @@ int main(int s_argc, char *s_argv[]) {
     }
 
     // If batch file is there run it in batch mode 
-    if (batch) {
+    if (batch && compile) {
+        compiled_batch_mode(s_argv[arg]);
+    } else if (batch) {
         batch_mode();
     } else {
         interactive_mode();
@@ -119,6 +180,8 @@ int main(int s_argc, char *s_argv[]) {
  * where the user is able to directly interact with the shell
  */
 void interactive_mode() {
+    events_init();
+
     // MAIN LOOP
     while (1) {
         // User cursor location
@@ -130,6 +193,9 @@ void interactive_mode() {
         // Initialize user_input buffer
         char user_input[10000];
         int input_length = 0;
+        line_buffer = user_input;
+        line_length = &input_length;
+        begin_input();
 
         // Get user input through getch function
         char key_press;
@@ -141,7 +207,8 @@ void interactive_mode() {
                 // ESC, which is the beginning of an escape sequence for arrow keys
                 case 27: 
                     // Read Arrow Keys ([A for up and [B for down)
-                    if (getch() == '[') {
+                    // A lone ESC doesn't wait forever for the rest of the sequence
+                    if (read_key(ESCAPE_TIMEOUT_MS) == '[') {
                         char arrow_key = getch();
                             switch (arrow_key) {
                                 case 'A': // Up Arrow
@@ -243,6 +310,7 @@ void interactive_mode() {
                     break;
             }
         }
+        end_input();
         printf("\n");
 
         // Null-terminate the user_input string
@@ -251,12 +319,7 @@ void interactive_mode() {
         // Parse user_input if it's not empty
         if (strlen(user_input) > 0) {
             // Put the command into history
-            history[++history_size] = strdup(user_input);
-            if (history[history_size] == NULL) {
-                printf("Error: Memory allocation failed for history entry.\n");
-            } else {
-                history_index = history_size;
-            }
+            add_history(user_input, input_length);
 
             // Command read properly parse into argc and argv
             int argc = 0;
@@ -304,14 +367,19 @@ void batch_mode() {
     char *user_input = NULL; 
     size_t input_size = 0;
 
-    while (getline(&user_input, &input_size, batch_file) != -1) {
+    // Jobs must not run without the limits they were given
+    if (load_batch_limits() != 0) {
+        printf("Error: batch file not run.\n");
+        return;
+    }
+
+    // Here-document bodies come from the lines following the command
+    heredoc_input = batch_file;
+
+    ssize_t input_length;
+    while ((input_length = getline(&user_input, &input_size, batch_file)) != -1) {
         // Put the command into history
-        history[++history_size] = strdup(user_input);
-        if (history[history_size] == NULL) {
-            printf("Error: Memory allocation failed for history entry.\n");
-        } else {
-            history_index = history_size;
-        }
+        add_history(user_input, input_length);
 
         // Command read properly parse into argc and argv
         int argc = 0;
@@ -333,9 +401,10 @@ void batch_mode() {
         argv[argc] = NULL;
 
         // Check if history command, if so print it out here, else send to parse
+        // Blank lines are skipped
         if (argc >= 1 && strcmp(argv[0], "history") == 0) {
             display_history();
-        } else {
+        } else if (argc >= 1) {
             // Send argc and argv to be parsed
             parse(argc, argv);
         }
@@ -349,6 +418,57 @@ void batch_mode() {
 
     // Free memory allocated for getline
     free(user_input);
+    heredoc_input = NULL;
+    clear_batch_limits();
+}
+
+/**
+ * Batch mode for a compiled batch file (./shell -C files.bat)
+ * 
+ * Runs the parsed commands from files.bat.bc, compiling it first 
+ *      if it is missing or out of date
+ * Falls back to the regular batch mode if the file can't be compiled
+*/
+void compiled_batch_mode(const char *path) {
+    // Jobs must not run without the limits they were given
+    if (load_batch_limits() != 0) {
+        printf("Error: batch file not run.\n");
+        return;
+    }
+
+    struct batch_image image;
+    uint64_t start = trace_now();
+    int result = batch_image_open(path, &image);
+    trace_span("load", path, start);
+    if (result != 0) {
+        printf("Error: unable to compile batch file, running it directly.\n");
+        batch_mode();
+        return;
+    }
+
+    // Here-document bodies were read with their line when it was compiled
+    struct bc_line *line;
+    while ((line = batch_image_next(&image)) != NULL) {
+        // Put the command into history
+        add_history(image.script + line->line_start, line->line_length);
+
+        if (line->argc == 0) {
+            continue;
+        }
+
+        // Lines parsed when compiling run straight away
+        // History and syntax errors are left to the regular path
+        if (line->tree.root != NULL) {
+            run_parsed(&line->tree, line->argc, line->argv);
+        } else if (strcmp(line->argv[0], "history") == 0) {
+            display_history();
+        } else {
+            parse(line->argc, line->argv);
+        }
+    }
+
+    clear_batch_limits();
+    batch_image_close(&image);
 }
 
 /**
@@ -404,6 +524,22 @@ void display_history() {
     }
 }
 
+/**
+ * Puts a command into the history list
+ * Once the list is full the command is dropped
+*/
+void add_history(const char *line, size_t length) {
+    if (history_size + 1 >= (int) (sizeof(history) / sizeof(history[0]))) {
+        return;
+    }
+    history[history_size + 1] = strndup(line, length);
+    if (history[history_size + 1] == NULL) {
+        printf("Error: Memory allocation failed for history entry.\n");
+    } else {
+        history_index = ++history_size;
+    }
+}
+
 /**
  * Simple function to return the max value of two integers
 */
@@ -450,10 +586,10 @@ char getch_(int echo)
   return ch;
 }
 
-/* Read 1 character without echo */
+/* Read 1 character without echo, servicing events until one arrives */
 char getch(void) 
 {
-  return getch_(0);
+  return read_key(-1);
 }
 
 /* Read 1 character with echo */
@@ -461,3 +597,231 @@ char getche(void)
 {
   return getch_(1);
 }
+
+/**
+ * Closes whatever events_init() opened, keys are then read directly
+*/
+static void events_close() {
+    int *fds[] = {&epoll_fd, &signal_fd, &timer_fd};
+    for (int i = 0; i < 3; i++) {
+        if (*fds[i] != -1) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * Sets up the epoll loop used while waiting for keys
+ * 
+ * Watches the terminal, a signalfd for SIGCHLD, SIGWINCH, SIGINT and SIGUSR1 
+ *      and a timerfd used for escape sequence timeouts
+ * If stdin can't be polled (a regular file) keys are read directly
+*/
+void events_init() {
+    // Set up once, a loop that failed isn't tried again
+    static bool tried = false;
+    if (tried) {
+        return;
+    }
+    tried = true;
+
+    sigemptyset(&loop_signals);
+    sigaddset(&loop_signals, SIGCHLD);
+    sigaddset(&loop_signals, SIGWINCH);
+    sigaddset(&loop_signals, SIGINT);
+    sigaddset(&loop_signals, SIGUSR1);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &loop_signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (epoll_fd == -1 || signal_fd == -1 || timer_fd == -1) {
+        printf("Error: unable to set up the event loop.\n");
+        events_close();
+        return;
+    }
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.fd = 0;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, 0, &event) == -1) {
+        events_close();
+        return;
+    }
+    event.data.fd = signal_fd;
+    bool added = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == 0;
+    event.data.fd = timer_fd;
+    if (!added || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1) {
+        printf("Error: unable to set up the event loop.\n");
+        events_close();
+    }
+}
+
+/**
+ * Gets the terminal and signals ready for reading a line
+ * 
+ * Signals are only routed to the signalfd while a line is read, 
+ *      commands still run with the normal signal mask
+*/
+void begin_input() {
+    initTermios(0);
+    sigprocmask(SIG_BLOCK, &loop_signals, &saved_mask);
+    // Report jobs that finished while the last command ran
+    reap_jobs();
+}
+
+/**
+ * Puts the terminal and signal mask back before running a command
+*/
+void end_input() {
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    resetTermios();
+}
+
+/**
+ * Waits for the next key press
+ * Signals and timers that fire in the meantime are handled here
+ * 
+ * With timeout_ms >= 0 gives up after that long and returns KEY_TIMEOUT
+ * Exits the shell once the terminal is closed
+*/
+int read_key(int timeout_ms) {
+    unsigned char key;
+    ssize_t n;
+
+    // Nothing else flushes the prompt and echoed keys before blocking
+    fflush(stdout);
+
+    if (epoll_fd == -1) {
+        // Nothing to poll, just block on stdin
+        n = read(0, &key, 1);
+    } else {
+        if (timeout_ms >= 0) {
+            struct itimerspec timeout = {0};
+            timeout.it_value.tv_sec = timeout_ms / 1000;
+            timeout.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            timerfd_settime(timer_fd, 0, &timeout, NULL);
+        }
+
+        n = -1;
+        bool waiting = true;
+        while (waiting) {
+            struct epoll_event events[3];
+            int count = epoll_wait(epoll_fd, events, 3, -1);
+            if (count == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            for (int i = 0; i < count; i++) {
+                if (events[i].data.fd == signal_fd) {
+                    handle_signals();
+                } else if (events[i].data.fd == timer_fd) {
+                    uint64_t expirations;
+                    if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+                        return KEY_TIMEOUT;
+                    }
+                } else {
+                    n = read(0, &key, 1);
+                    if (n != -1 || errno != EINTR) {
+                        waiting = false;
+                    }
+                }
+            }
+        }
+
+        // Disarm the timer so it can't fire later
+        if (timeout_ms >= 0) {
+            struct itimerspec off = {0};
+            timerfd_settime(timer_fd, 0, &off, NULL);
+        }
+    }
+
+    if (n <= 0) {
+        // Terminal closed
+        end_input();
+        printf("\n");
+        exit(last_status);
+    }
+    return key;
+}
+
+/**
+ * Handles every signal queued on the signalfd
+*/
+void handle_signals() {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGINT:
+                // Same as sig_handler, toggles autocomplete
+                is_auto = !is_auto;
+                break;
+            case SIGWINCH:
+                redraw_line();
+                break;
+            case SIGCHLD:
+                reap_jobs();
+                break;
+            case SIGUSR1:
+                // Write the trace, if tracing
+                trace_dump_requested = 1;
+                trace_poll();
+                break;
+        }
+    }
+}
+
+/**
+ * Reports every background job that has finished
+ * and redraws the line being edited below the report
+*/
+void reap_jobs() {
+    bool reported = false;
+    int status;
+    pid_t pid;
+    while (true) {
+        // Jobs a builtin already reaped come first
+        int exit_status;
+        if (!take_finished_job(&pid, &exit_status)) {
+            if ((pid = waitpid(-1, &status, WNOHANG)) <= 0) {
+                break;
+            }
+            exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+        if (!reported) {
+            // Clear the line being edited
+            printf("\r\033[K");
+        }
+        reported = true;
+        printf("Background Process: %d done (exit status %d)\n", pid, exit_status);
+    }
+    if (reported) {
+        redraw_line();
+    }
+}
+
+/**
+ * Prints the user cursor
+*/
+void print_prompt() {
+    // Sky Blue ANSI escape sequence
+    printf("\033[38;5;39m");
+    printf("> ");
+    printf("\033[0m");
+}
+
+/**
+ * Clears the current line and prints the prompt and input again
+*/
+void redraw_line() {
+    if (line_buffer == NULL) {
+        return;
+    }
+    printf("\r\033[K");
+    print_prompt();
+    printf("%.*s", *line_length, line_buffer);
+    fflush(stdout);
+}
@@ -0,0 +1,358 @@
+/**
+ * Implementation File for execution tracing
+ *
+ * Events go into a fixed size buffer mapped MAP_SHARED, so forked
+ *      subshells can record their own spans
+ * Writers claim a slot with an atomic increment and mark it ready
+ *      once filled in, so nothing ever takes a lock
+ *
+ * @author Sam Kapp
+*/
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Number of events kept unless $SHELL_TRACE_EVENTS says otherwise,
+//      later ones are counted as dropped
+#define TRACE_CAPACITY 65536
+#define TRACE_DEFAULT_FILE "shell_trace.json"
+#define TRACE_DETAIL_SIZE 100
+
+struct trace_event {
+    uint64_t start;
+    uint64_t duration;
+    int32_t pid;
+    // 'X' for a span, 'i' for an instant event
+    char phase;
+    char name[11];
+    atomic_int ready;
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+struct trace_buffer {
+    atomic_uint_fast64_t next;
+    uint64_t origin;
+    uint64_t capacity;
+    struct trace_event events[];
+};
+
+static struct trace_buffer *buffer = NULL;
+static size_t buffer_size = 0;
+// Only the shell that started tracing writes the trace on exit
+static pid_t owner = -1;
+static char trace_path[4096];
+static bool exit_hook = false;
+
+volatile sig_atomic_t trace_dump_requested = 0;
+
+/**
+ * sig handler for SIGUSR1, asks for the trace to be written
+*/
+static void dump_handler(int signo) {
+    trace_dump_requested = 1;
+}
+
+/**
+ * Writes the trace when the shell exits
+*/
+static void dump_at_exit(void) {
+    if (buffer != NULL && getpid() == owner) {
+        trace_dump(trace_path);
+    }
+}
+
+/**
+ * Returns the monotonic clock in nanoseconds
+*/
+static uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Starts tracing, the trace is written to $SHELL_TRACE_FILE
+ *      (shell_trace.json in the current directory by default)
+ *      on exit, on SIGUSR1 or with trace dump
+ * Up to $SHELL_TRACE_EVENTS events are kept (65536 by default)
+*/
+int trace_start() {
+    if (buffer != NULL) {
+        return 0;
+    }
+
+    uint64_t capacity = TRACE_CAPACITY;
+    char *events = getenv("SHELL_TRACE_EVENTS");
+    if (events != NULL) {
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(events, &end, 10);
+        if (errno != 0 || end == events || *end != '\0' || events[0] == '-' || value == 0 ||
+            value > (SIZE_MAX - sizeof(struct trace_buffer)) / sizeof(struct trace_event)) {
+            printf("trace: invalid SHELL_TRACE_EVENTS %s.\n", events);
+            return 1;
+        }
+        capacity = value;
+    }
+
+    buffer_size = sizeof(struct trace_buffer) + capacity * sizeof(struct trace_event);
+    buffer = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        buffer = NULL;
+        printf("trace: mmap() error.\n");
+        return 1;
+    }
+    atomic_init(&buffer->next, 0);
+    buffer->capacity = capacity;
+    buffer->origin = clock_ns();
+    owner = getpid();
+
+    // Resolve the path now so a later cd doesn't move it
+    char *path = getenv("SHELL_TRACE_FILE");
+    if (path != NULL && path[0] == '/') {
+        snprintf(trace_path, sizeof(trace_path), "%s", path);
+    } else {
+        char cwd[2048];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            strcpy(cwd, ".");
+        }
+        snprintf(trace_path, sizeof(trace_path), "%s/%s", cwd, (path != NULL) ? path : TRACE_DEFAULT_FILE);
+    }
+
+    // No SA_RESTART, so a shell waiting on a long command wakes up 
+    //      with EINTR and writes the trace straight away
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    if (!exit_hook) {
+        atexit(dump_at_exit);
+        exit_hook = true;
+    }
+    return 0;
+}
+
+/**
+ * Stops tracing and throws away the recorded events
+*/
+void trace_stop() {
+    if (buffer != NULL) {
+        munmap(buffer, buffer_size);
+        buffer = NULL;
+    }
+    signal(SIGUSR1, SIG_DFL);
+}
+
+/**
+ * Returns non-zero while tracing
+*/
+int trace_active() {
+    return buffer != NULL;
+}
+
+/**
+ * Returns the time to start a span with, 0 when not tracing
+*/
+uint64_t trace_now() {
+    return (buffer != NULL) ? clock_ns() : 0;
+}
+
+/**
+ * Claims the next free event, NULL once the buffer is full
+ * Whoever finds it full first warns that events are being dropped
+*/
+static struct trace_event *claim() {
+    uint64_t slot = atomic_fetch_add(&buffer->next, 1);
+    if (slot >= buffer->capacity) {
+        if (slot == buffer->capacity) {
+            fprintf(stderr, "trace: buffer full after %llu events, later ones are dropped "
+                    "(raise SHELL_TRACE_EVENTS).\n", (unsigned long long) buffer->capacity);
+        }
+        return NULL;
+    }
+    return &buffer->events[slot];
+}
+
+/**
+ * Records an event and marks it ready for trace_dump()
+*/
+static void record(char phase, const char *name, const char *detail, uint64_t start, uint64_t end) {
+    struct trace_event *event = claim();
+    if (event == NULL) {
+        return;
+    }
+    event->start = start;
+    event->duration = end - start;
+    event->pid = getpid();
+    event->phase = phase;
+    snprintf(event->name, sizeof(event->name), "%s", name);
+    snprintf(event->detail, sizeof(event->detail), "%s", (detail != NULL) ? detail : "");
+    atomic_store(&event->ready, 1);
+}
+
+/**
+ * Records a span from start (taken with trace_now()) until now
+*/
+void trace_span(const char *name, const char *detail, uint64_t start) {
+    if (buffer == NULL || start == 0) {
+        return;
+    }
+    record('X', name, detail, start, clock_ns());
+}
+
+/**
+ * Records a span whose detail is the command line in argv
+*/
+void trace_span_argv(const char *name, int argc, char *argv[], uint64_t start) {
+    if (buffer == NULL || start == 0) {
+        return;
+    }
+    uint64_t end = clock_ns();
+
+    char detail[TRACE_DETAIL_SIZE];
+    size_t len = 0;
+    detail[0] = '\0';
+    for (int i = 0; i < argc && argv[i] != NULL && len < sizeof(detail) - 1; i++) {
+        len += snprintf(detail + len, sizeof(detail) - len, (i == 0) ? "%s" : " %s", argv[i]);
+    }
+    record('X', name, detail, start, end);
+}
+
+/**
+ * Records a single point in time, such as an error
+*/
+void trace_instant(const char *name, const char *detail) {
+    if (buffer == NULL) {
+        return;
+    }
+    uint64_t now = clock_ns();
+    record('i', name, detail, now, now);
+}
+
+/**
+ * Prints str as a JSON string
+*/
+static void print_json_string(FILE *file, const char *str) {
+    fputc('"', file);
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/**
+ * Writes every recorded event to path as Chrome trace event JSON
+ * Each process gets its own row, named by its pid
+*/
+int trace_dump(const char *path) {
+    if (buffer == NULL) {
+        printf("trace: not tracing.\n");
+        return 1;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        printf("trace: unable to open %s.\n", path);
+        return 1;
+    }
+
+    uint64_t count = atomic_load(&buffer->next);
+    uint64_t dropped = 0;
+    if (count > buffer->capacity) {
+        dropped = count - buffer->capacity;
+        count = buffer->capacity;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (uint64_t i = 0; i < count; i++) {
+        struct trace_event *event = &buffer->events[i];
+        // Skip events still being written
+        if (!atomic_load(&event->ready)) {
+            continue;
+        }
+        fprintf(file, "%s{\"name\":", first ? "" : ",\n");
+        print_json_string(file, event->name);
+        fprintf(file, ",\"cat\":\"shell\",\"ph\":\"%c\",\"ts\":%.3f,",
+                event->phase, (event->start - buffer->origin) / 1000.0);
+        if (event->phase == 'X') {
+            fprintf(file, "\"dur\":%.3f,", event->duration / 1000.0);
+        } else {
+            fprintf(file, "\"s\":\"t\",");
+        }
+        fprintf(file, "\"pid\":%d,\"tid\":%d,\"args\":{\"cmd\":", (int) owner, (int) event->pid);
+        print_json_string(file, event->detail);
+        fprintf(file, "}}");
+        first = false;
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%llu}}\n",
+            (unsigned long long) dropped);
+
+    if (fclose(file) != 0) {
+        printf("trace: error writing %s.\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the trace if SIGUSR1 asked for it
+ * Called between commands and when a wait is interrupted, 
+ *      where writing a file is safe
+*/
+void trace_poll() {
+    if (trace_dump_requested) {
+        trace_dump_requested = 0;
+        if (buffer != NULL) {
+            trace_dump(trace_path);
+        }
+    }
+}
+
+/**
+ * Executes the trace builtin
+ *
+ * trace on             start tracing
+ * trace off            stop tracing and drop the events
+ * trace dump [file]    write the trace now
+ * trace                show whether tracing is on and where it goes
+*/
+int trace_cmd(int argc, char *argv[]) {
+    if (argc == 1) {
+        if (buffer != NULL) {
+            uint64_t count = atomic_load(&buffer->next);
+            uint64_t dropped = (count > buffer->capacity) ? count - buffer->capacity : 0;
+            printf("trace: on, %llu events, %llu dropped, writing to %s\n",
+                   (unsigned long long) (count - dropped), (unsigned long long) dropped, trace_path);
+        } else {
+            printf("trace: off\n");
+        }
+        return 0;
+    } else if (strcmp(argv[1], "on") == 0 && argc == 2) {
+        return trace_start();
+    } else if (strcmp(argv[1], "off") == 0 && argc == 2) {
+        trace_stop();
+        return 0;
+    } else if (strcmp(argv[1], "dump") == 0 && argc <= 3) {
+        return trace_dump((argc == 3) ? argv[2] : trace_path);
+    }
+    printf("usage: trace [on | off | dump [file]]\n");
+    return 1;
+}
@@ -0,0 +1,32 @@
+/**
+ * Header file for execution tracing
+ *
+ * Records timed spans (parse, spawn, exec, wait) for every command
+ *      into a buffer shared with the shell's children and writes them
+ *      out as Chrome trace event JSON (chrome://tracing, Perfetto)
+ *
+ * Turned on with ./shell -x or the trace builtin
+ *
+ * @author Sam Kapp
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <signal.h>
+
+// Set by SIGUSR1 while tracing, the trace is written at the next command
+extern volatile sig_atomic_t trace_dump_requested;
+
+int trace_start();
+void trace_stop();
+int trace_active();
+uint64_t trace_now();
+void trace_span(const char *name, const char *detail, uint64_t start);
+void trace_span_argv(const char *name, int argc, char *argv[], uint64_t start);
+void trace_instant(const char *name, const char *detail);
+int trace_dump(const char *path);
+void trace_poll();
+int trace_cmd(int argc, char *argv[]);
+
+#endif